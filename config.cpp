@@ -1,3 +1,9 @@
 #include "config.h"
 
 Config config;
+
+const ExtractName extract_names[7] = {
+    {"decls", Config::EXTRACT_DECLS}, {"types", Config::EXTRACT_TYPES}, {"funcs", Config::EXTRACT_FUNCS},
+    {"calls", Config::EXTRACT_CALLS}, {"refs", Config::EXTRACT_REFS},   {"vars", Config::EXTRACT_VARS},
+    {"locals", Config::EXTRACT_LOCALS},
+};
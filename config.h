@@ -4,13 +4,65 @@
 #include <vector>
 
 struct Config {
+    enum Comments { COMMENTS_NONE, COMMENTS_BRIEF, COMMENTS_FULL };
+
+    // What --extract writes; see extract_names.
+    enum Extract {
+        EXTRACT_DECLS = 1 << 0,   // classes, enums, typedefs, fields, bases
+        EXTRACT_TYPES = 1 << 1,   // type, type_argument, for the types of EXTRACT_TYPE_USERS
+        EXTRACT_FUNCS = 1 << 2,   // func, func_param, method_override
+        EXTRACT_CALLS = 1 << 3,   // fcall
+        EXTRACT_REFS = 1 << 4,    // var_ref
+        EXTRACT_VARS = 1 << 5,    // var_decl for globals and members
+        EXTRACT_LOCALS = 1 << 6,  // var_decl for locals and parameters
+        EXTRACT_ALL = (1 << 7) - 1,
+        // Types are written as fields, functions and variables use them.
+        EXTRACT_TYPE_USERS = EXTRACT_DECLS | EXTRACT_FUNCS | EXTRACT_VARS | EXTRACT_LOCALS,
+    };
+
     std::string db_name;
     bool truncate;
     std::vector<std::string> accept_paths;
     bool verbose;
+    int commit_every;
+    bool fast_load;
+    bool defer_indexes;
+    bool async_writes;
+    bool hash_ids;
+    std::string compdb_dir;
+    std::vector<std::string> compdb_filters;
+    std::vector<std::string> remove_paths;  // --remove
+    int jobs;
+    int shard_index;  // --shard I/N
+    int shard_count;
+    bool skip_indexed_headers;
+    Comments comments;
+    unsigned extract;
 
-    Config() : db_name("ctypefind.db"), truncate(false), verbose(false) {
+    Config()
+        : db_name("ctypefind.db"),
+          truncate(false),
+          verbose(false),
+          commit_every(0),
+          fast_load(false),
+          defer_indexes(false),
+          async_writes(false),
+          hash_ids(false),
+          jobs(1),
+          shard_index(0),
+          shard_count(1),
+          skip_indexed_headers(true),
+          comments(COMMENTS_NONE),
+          extract(EXTRACT_ALL) {
     }
 };
 
 extern Config config;
+
+struct ExtractName {
+    const char *name;
+    unsigned flag;
+};
+
+// The --extract names, in the order they are written to the meta table.
+extern const ExtractName extract_names[7];
@@ -1,28 +1,380 @@
 #include "db.h"
-#include "sql.h"
 #include "util.h"
 #include <unistd.h>
+#include <algorithm>
 #include <cstdio>
+#include <cstring>
+#include <future>
 
 #define log_error(fmt, ...) fprintf(stderr, fmt "\n", ##__VA_ARGS__)
 
 namespace db {
 
-Database::Database(const char *dbname) : db_(nullptr) {
+static const struct {
+    const char *name;
+    const char *table;
+    const char *columns;
+} unique_keys[] = {
+    {"uk_string", "string", "value"},
+    {"uk_file", "file", "path"},
+    {"uk_decl", "decl", "name_id"},
+    {"uk_template_parameter", "template_parameter", "template_type, template_id, name"},
+    {"uk_decl_base", "decl_base", "decl_id, base_id"},
+    {"uk_decl_tree", "decl_tree", "decl_id, base_id, level"},
+    {"uk_type", "type", "name_id, template_parameter_index"},
+    {"uk_type_argument_template_index", "type_argument", "type_id, `index`"},
+    {"uk_decl_field", "decl_field", "decl_id, name"},
+    {"uk_enum_field", "enum_field", "enum_id, name"},
+    {"uk_func", "func", "signature_id"},
+    {"uk_func_param", "func_param", "func_id, position"},
+    {"uk_method_override", "method_override", "method_id, overridden_method_id"},
+    {"uk_var_decl", "var_decl", "file_id, end_line, end_column"},
+    {"uk_var_ref", "var_ref", "file_id, end_line, end_column"},
+    {"uk_fcall", "fcall", "file_id, end_line, end_column"},
+    {"uk_comment", "comment", "owner_type, owner_id"},
+    {"uk_tu_dependency", "tu_dependency", "tu_id, file_id"},
+};
+
+// Foreign key columns that no unique key starts with, so cascading deletes
+// find the rows that reference a deleted one. References to `type` are left
+// out: types are only deleted by clear(), after everything else.
+static const struct {
+    const char *name;
+    const char *table;
+    const char *columns;
+} lookup_keys[] = {
+    {"ix_decl_file", "decl", "file_id"},
+    {"ix_decl_base_base", "decl_base", "base_id"},
+    {"ix_decl_tree_base", "decl_tree", "base_id"},
+    {"ix_decl_field_file", "decl_field", "file_id"},
+    {"ix_enum_field_file", "enum_field", "file_id"},
+    {"ix_func_file", "func", "file_id"},
+    {"ix_func_decl", "func", "decl_id"},
+    {"ix_method_override_overridden_method", "method_override", "overridden_method_id"},
+    {"ix_var_decl_class", "var_decl", "class_id"},
+    {"ix_var_ref_var", "var_ref", "var_id"},
+    {"ix_fcall_func", "fcall", "func_id"},
+    {"ix_tu_dependency_file", "tu_dependency", "file_id"},
+};
+
+// Tables added after the string table; a database that has the current
+// schema otherwise but lacks them gets them when it is opened.
+static const char *added_tables = R"sql(
+-- What the database holds, e.g. the --extract profile it was written with.
+create table if not exists meta(
+  `key` varchar(100) primary key,
+  value text
+);
+
+-- Doc comments of decl, decl_field, enum_field and func rows, with --comments.
+create table if not exists comment(
+  id integer primary key,
+  owner_type varchar(20) not null,
+  owner_id int,
+  brief_comment text,
+  comment text
+);
+)sql";
+
+struct CommentRow {
+    Id id;
+    std::string owner_type;
+    Id owner_id;
+    Comment comment;
+};
+
+// Strings are bound without a copy: every caller steps the statement before
+// the bound row goes out of scope, and rebinds all parameters on the next use.
+static void bind(sqlite3_stmt *stmt, int index, const std::string &value, bool use_null_for_empty = true) {
+    if (value.empty() && use_null_for_empty) {
+        sqlite3_bind_null(stmt, index);
+    } else {
+        sqlite3_bind_text(stmt, index, value.c_str(), (int)value.size(), SQLITE_STATIC);
+    }
+}
+
+static void bind(sqlite3_stmt *stmt, int index, int value) {
+    sqlite3_bind_int(stmt, index, value);
+}
+
+static void bind(sqlite3_stmt *stmt, int index, Id value) {
+    sqlite3_bind_int64(stmt, index, value);
+}
+
+// Binds a reference to another row, using null when there is none.
+static void bind_pk(sqlite3_stmt *stmt, int index, Id value) {
+    if (value <= 0) {
+        sqlite3_bind_null(stmt, index);
+    } else {
+        sqlite3_bind_int64(stmt, index, value);
+    }
+}
+
+// The hash id of a row: FNV-1a of its unique key, cut to 63 bits so it is a
+// positive rowid. Integers are hashed in host byte order.
+static Id hash_key(const std::string &name, Id a, Id b, Id c) {
+    uint64_t hash = fnv1a(name);
+    for (Id n : {a, b, c}) {
+        hash = fnv1a(&n, sizeof(n), hash);
+    }
+    Id id = (Id)(hash >> 1);
+    return id != 0 ? id : 1;
+}
+
+static void bind_location(sqlite3_stmt *stmt, int index, const Location &location) {
+    bind(stmt, index, location.start_line);
+    bind(stmt, index + 1, location.end_line);
+    bind(stmt, index + 2, location.start_column);
+    bind(stmt, index + 3, location.end_column);
+}
+
+Database::Database(const char *dbname, const Options &options)
+    : db_(nullptr),
+      stmts_(),
+      options_(options),
+      deferring_(false),
+      next_ids_(),
+      begin_ids_(),
+      queue_(4096),
+      collisions_(0),
+      in_transaction_(false),
+      commit_interval_(0),
+      pending_writes_(0),
+      batch_committed_(false),
+      outdated_(false) {
     auto error = sqlite3_open(dbname, &db_);
     if (error != 0) {
         log_error("Failed to open %s: %s", dbname, sqlite3_errstr(error));
-    } else if (table_count() == 0) {
+        sqlite3_close(db_);
+        db_ = nullptr;
+        return;
+    }
+
+    // Other processes may read the database, and write to it between this
+    // one's transactions; a transaction waits for theirs to finish.
+    sqlite3_busy_timeout(db_, 60 * 1000);
+
+    if (options_.fast_load) {
+        // page_size only takes effect before the first table is created.
+        exec_script(R"sql(
+pragma page_size = 65536;
+pragma journal_mode = wal;
+pragma synchronous = off;
+pragma cache_size = -262144;
+pragma temp_store = memory;
+pragma mmap_size = 1073741824;
+        )sql");
+    }
+
+    // Rows are deleted through the schema's cascades; see remove_file().
+    exec_script("pragma foreign_keys = on");
+
+    if (table_count() == 0) {
         create_tables();
+    } else if (has_current_schema()) {
+        exec_script(added_tables);
+        load_caches();
+    } else {
+        outdated_ = true;
+    }
+
+    if (options_.async_writes) {
+        writer_ = std::thread([this]() {
+            std::function<void()> fn;
+            for (;;) {
+                queue_.pop(fn);
+                if (!fn) {
+                    break;
+                }
+                fn();
+            }
+        });
     }
 }
 
 Database::~Database() {
+    if (db_ && !outdated_) {
+        finish();
+    }
+    if (writer_.joinable()) {
+        queue_.push(std::function<void()>());
+        writer_.join();
+    }
+    for (auto stmt : stmts_) {
+        sqlite3_finalize(stmt);
+    }
     if (db_) {
         sqlite3_close(db_);
     }
 }
 
+int Database::call(std::function<int()> fn) {
+    if (!writer_.joinable()) {
+        return fn();
+    }
+
+    std::promise<int> promise;
+    auto result = promise.get_future();
+    queue_.push([&promise, &fn]() { promise.set_value(fn()); });
+    return result.get();
+}
+
+int Database::finish() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int collisions = collisions_;
+    collisions_ = 0;
+
+    return call([this, collisions]() {
+        int errors = 0;
+
+        if (collisions > 0) {
+            log_error("%d rows were not written because their hash ids collide with other rows", collisions);
+            errors++;
+        }
+
+        if (in_transaction_ && commit_transaction() != 0) {
+            errors++;
+        }
+
+        if (deferring_) {
+            errors += create_indexes();
+            deferring_ = false;
+            row_keys_.clear();
+            exec_script("pragma foreign_keys = on");
+        }
+
+        if (!removed_funcs_.empty() && delete_removed_funcs() != 0) {
+            errors++;
+        }
+
+        if (update_decl_tree() != 0) {
+            errors++;
+        }
+
+        if (options_.fast_load) {
+            if (finish_load() != SQLITE_OK) {
+                errors++;
+            }
+            options_.fast_load = false;
+        }
+
+        return errors;
+    });
+}
+
+int Database::finish_load() {
+    return exec_script(R"sql(
+pragma synchronous = full;
+pragma wal_checkpoint(truncate);
+pragma journal_mode = delete;
+    )sql");
+}
+
+// Functions removed with their files and not written again are gone from
+// the sources; deleting them cascades to the calls and overrides that refer
+// to them.
+int Database::delete_removed_funcs() {
+    if (begin_transaction() != 0) {
+        return -1;
+    }
+
+    auto stmt = prepare(DELETE_FUNC, "delete from func where id = ?");
+    for (Id id : removed_funcs_) {
+        bind(stmt, 1, id);
+        if (exec(stmt) != 0) {
+            rollback_transaction();
+            return -1;
+        }
+    }
+
+    if (commit_transaction() != 0) {
+        return -1;
+    }
+
+    // The cascades do not update the key caches.
+    load_caches();
+    return 0;
+}
+
+int Database::update_decl_tree() {
+    if (dirty_decls_.empty()) {
+        return 0;
+    }
+
+    int result = exec_script("create temp table if not exists decl_tree_dirty(decl_id integer primary key)");
+    if (result != SQLITE_OK || begin_transaction() != 0) {
+        return -1;
+    }
+
+    auto stmt = prepare(INSERT_DECL_TREE_DIRTY, "insert or ignore into temp.decl_tree_dirty(decl_id) values (?)");
+    for (Id decl_id : dirty_decls_) {
+        bind(stmt, 1, decl_id);
+        exec(stmt);
+    }
+
+    // Classes deriving from a dirty decl inherit its new ancestors, so the
+    // whole subgraph below it is recomputed.
+    result = exec_script(R"sql(
+insert or ignore into temp.decl_tree_dirty(decl_id)
+with recursive affected(decl_id) as (
+  select decl_id from temp.decl_tree_dirty
+  union
+  select decl_base.decl_id from affected join decl_base on decl_base.base_id = affected.decl_id
+)
+select decl_id from affected;
+
+delete from decl_tree where decl_id in (select decl_id from temp.decl_tree_dirty);
+
+insert into decl_tree(decl_id, base_id, level)
+with recursive tree(decl_id, base_id, level) as (
+  select decl_id, base_id, 1 from decl_base where decl_id in (select decl_id from temp.decl_tree_dirty)
+  union
+  select tree.decl_id, decl_base.base_id, tree.level + 1 from tree join decl_base on decl_base.decl_id = tree.base_id
+)
+select decl_id, base_id, level from tree;
+
+delete from temp.decl_tree_dirty;
+    )sql");
+
+    if (result == SQLITE_OK && commit_transaction() == 0) {
+        dirty_decls_.clear();
+        return 0;
+    }
+
+    rollback_transaction();
+    return -1;
+}
+
+int Database::exec_script(const char *sql) {
+    char *errmsg;
+    int result = sqlite3_exec(db_, sql, nullptr, nullptr, &errmsg);
+
+    if (result != SQLITE_OK) {
+        log_error("Error executing query: %s", errmsg);
+        sqlite3_free(errmsg);
+    }
+
+    return result;
+}
+
+// Probes a table and the columns added last to the existing ones.
+bool Database::has_current_schema() {
+    static const char *queries[] = {
+        "select id, value from string",
+        "select name_id from decl",
+        "select context, macros from file",
+    };
+    for (const char *query : queries) {
+        sqlite3_stmt *stmt;
+        int result = sqlite3_prepare_v2(db_, query, -1, &stmt, nullptr);
+        sqlite3_finalize(stmt);
+        if (result != SQLITE_OK) {
+            return false;
+        }
+    }
+    return true;
+}
+
 int Database::table_count() {
     const char *query = "SELECT COUNT(*) FROM sqlite_master WHERE type='table'";
     sqlite3_stmt *stmt;
@@ -48,23 +400,46 @@ int Database::table_count() {
 
 int Database::create_tables() {
     const char *sql = R"sql(
+-- Names, signatures and type spellings, each stored once and referenced by
+-- the *_id columns of decl, type, type_argument and func. The v_* views at
+-- the end show those tables with the strings.
+create table string(
+  id integer primary key,
+  value text not null
+);
+
+-- size, mtime and hash describe the file as it was last indexed; context
+-- hashes the macros it was indexed with, including those it tests or
+-- expands, listed in macros.
 create table `file`(
   id integer primary key,
   path varchar(1024),
-  constraint uk_file unique(path)
+  size int,
+  mtime int,
+  hash int,
+  include_guarded bool,
+  context int,
+  macros text
+);
+
+-- The files each translation unit read, by the file id of its main file.
+create table tu_dependency(
+  id integer primary key,
+  tu_id int,
+  file_id int,
+  constraint fk_tu_dependency_tu foreign key (tu_id) references `file`(id) on delete cascade,
+  constraint fk_tu_dependency_file foreign key (file_id) references `file`(id) on delete cascade
 );
 
 create table decl(
   id integer primary key,
   type varchar(60),
-  name varchar(1024),
+  name_id int,
   file_id int,
   start_line int,
   end_line int,
   start_column int,
   end_column int,
-  brief_comment text,
-  comment text,
 
   -- typedef and using
   underlying_type varchar(100),
@@ -74,7 +449,6 @@ create table decl(
   is_template bool,
   is_scoped bool,
 
-  constraint uk_decl unique(name),
   constraint fk_decl_file foreign key (file_id) references `file`(id) on delete cascade
 );
 
@@ -87,9 +461,7 @@ create table template_parameter(
   name varchar(100),
   value varchar(200),
   is_variadic bool,
-  `index` int, 
-  constraint uk_template_parameter unique(template_type, template_id, name),
-  constraint fk_template_parameter_template foreign key (template_id) references decl(id) on delete cascade
+  `index` int
 );
 
 create table decl_base(
@@ -98,7 +470,6 @@ create table decl_base(
   base_id int,
   position int,
   access varchar(30),
-  constraint uk_decl_base unique(decl_id, base_id),
   constraint fk_decl_base_decl foreign key (decl_id) references decl(id) on delete cascade,
   constraint fk_decl_base_base foreign key (base_id) references decl(id) on delete cascade
 );
@@ -108,31 +479,28 @@ create table decl_tree(
   decl_id int,
   base_id int,
   level int,
-  constraint uk_decl_tree unique(decl_id, base_id, level),
   constraint fk_decl_tree_decl foreign key (decl_id) references decl(id) on delete cascade,
   constraint fk_decl_tree_base foreign key (base_id) references decl(id) on delete cascade
 );
 
 create table `type`(
   id integer primary key,
-  name varchar(200) not null,
-  decl_name varchar(200) not null,
+  name_id int not null,
+  decl_name_id int not null,
   decl_kind varchar(30),
   indirection varchar(20),
-  template_parameter_index int,
-  constraint uk_type unique(name, template_parameter_index)
+  template_parameter_index int
 );
 
 create table `type_argument`(
   id integer primary key,
   type_id int,
   kind varchar(32),
-  `value` varchar(200),
+  value_id int,
   `index` int,
   referenced_type_id int,
   constraint fk_type_argument_template foreign key (type_id) references `type`(id) on delete cascade,
-  constraint fk_type_argument_template foreign key (referenced_type_id) references `type`(id) on delete cascade,
-  constraint uk_type_argument_template_index unique(type_id, `index`)
+  constraint fk_type_argument_referenced_type foreign key (referenced_type_id) references `type`(id) on delete cascade
 );
 
 create table decl_field(
@@ -141,14 +509,12 @@ create table decl_field(
   type_id int,
   name varchar(100),
   access varchar(30),
-  brief_comment text,
-  comment text,
   file_id int,
   start_line int,
   end_line int,
   start_column int,
   end_column int,
-  constraint uk_decl_field unique(decl_id, name),
+  constraint fk_decl_field_file foreign key (file_id) references `file`(id) on delete cascade,
   constraint fk_decl_field_decl foreign key (decl_id) references decl(id) on delete cascade,
   constraint fk_decl_field_type foreign key (type_id) references `type`(id) on delete cascade
 );
@@ -158,28 +524,25 @@ create table enum_field(
   enum_id int,
   name varchar(100),
   value int,
-  brief_comment text,
-  comment text,
   file_id int,
   start_line int,
   end_line int,
   start_column int,
   end_column int,
-  constraint uk_enum_field unique(enum_id, name)
+  constraint fk_enum_field_file foreign key (file_id) references `file`(id) on delete cascade,
+  constraint fk_enum_field_enum foreign key (enum_id) references decl(id) on delete cascade
 );
 
 create table func(
   id integer primary key,
   name varchar(200),
-  qual_name varchar(200),
-  signature varchar(512),
+  qual_name_id int,
+  signature_id int,
   file_id int,
   start_line int,
   end_line int,
   start_column int,
   end_column int,
-  brief_comment text,
-  comment text,
   decl_id int,
   type_id int,
   access varchar(32),
@@ -190,7 +553,6 @@ create table func(
   is_ctor bool,
   is_overriding bool,
   is_const bool,
-  constraint uk_func unique(signature),
   constraint fk_func_file foreign key (file_id) references file(id) on delete cascade,
   constraint fk_func_type foreign key (type_id) references `type`(id) on delete cascade,
   constraint fk_func_class foreign key (decl_id) references decl(id) on delete cascade
@@ -203,7 +565,6 @@ create table func_param(
   type_id int,
   name varchar(200),
   default_value varchar(200),
-  constraint uk_func_param unique(func_id, position),
   constraint fk_func_param_type foreign key (type_id) references `type`(id) on delete cascade,
   constraint fk_func_param_func foreign key (func_id) references func(id) on delete cascade
 );
@@ -212,7 +573,6 @@ create table method_override(
   id integer primary key,
   method_id int,
   overridden_method_id int,
-  constraint uk_method_override unique(method_id, overridden_method_id),
   constraint fk_method_override_method foreign key (method_id) references func(id) on delete cascade,
   constraint fk_method_override_overridden_method foreign key (overridden_method_id) references func(id) on delete cascade
 );
@@ -227,7 +587,6 @@ create table var_decl(
   end_line int,
   start_column int,
   end_column int,
-  constraint uk_var_decl unique(file_id, end_line, end_column),
   constraint fk_var_decl_file foreign key (file_id) references file(id) on delete cascade,
   constraint fk_var_decl_class foreign key (class_id) references `decl`(id) on delete cascade,
   constraint fk_var_decl_type foreign key (type_id) references `type`(id) on delete cascade
@@ -241,7 +600,7 @@ create table var_ref(
   end_line int,
   start_column int,
   end_column int,
-  constraint uk_var_ref unique(file_id, end_line, end_column),
+  constraint fk_var_ref_file foreign key (file_id) references `file`(id) on delete cascade,
   constraint fk_var_ref_var foreign key (var_id) references var_decl(id) on delete cascade
 );
 
@@ -253,345 +612,1696 @@ create table fcall(
   end_line int,
   start_column int,
   end_column int,
-  constraint uk_fcall unique(file_id, end_line, end_column),
+  constraint fk_fcall_file foreign key (file_id) references `file`(id) on delete cascade,
   constraint fk_fcall_func foreign key (func_id) references func(id) on delete cascade
 );
-)sql";
 
-    char *errmsg;
-    int result = sqlite3_exec(db_, sql, nullptr, nullptr, &errmsg);
+-- template_parameter and comment rows belong to rows of several tables, so
+-- they are deleted with their owners by triggers instead of foreign keys.
+create trigger td_decl after delete on decl begin
+  delete from template_parameter where template_type = 'class' and template_id = old.id;
+  delete from comment where owner_type = 'decl' and owner_id = old.id;
+end;
+
+create trigger td_func after delete on func begin
+  delete from template_parameter where template_type = 'function' and template_id = old.id;
+  delete from comment where owner_type = 'func' and owner_id = old.id;
+end;
+
+create trigger td_decl_field after delete on decl_field begin
+  delete from comment where owner_type = 'decl_field' and owner_id = old.id;
+end;
+
+create trigger td_enum_field after delete on enum_field begin
+  delete from comment where owner_type = 'enum_field' and owner_id = old.id;
+end;
+
+create view v_decl as
+select decl.id, type, s.value as name, file_id, start_line, end_line, start_column, end_column, underlying_type,
+  is_struct, is_abstract, is_template, is_scoped
+from decl left join string s on s.id = decl.name_id;
+
+create view v_type as
+select `type`.id, s.value as name, d.value as decl_name, decl_kind, indirection, template_parameter_index
+from `type` left join string s on s.id = `type`.name_id left join string d on d.id = `type`.decl_name_id;
+
+create view v_type_argument as
+select type_argument.id, type_id, kind, s.value as value, `index`, referenced_type_id
+from type_argument left join string s on s.id = type_argument.value_id;
+
+create view v_func as
+select func.id, name, q.value as qual_name, s.value as signature, file_id, start_line, end_line, start_column,
+  end_column, decl_id, type_id, access, is_static, is_inline, is_virtual, is_pure, is_ctor, is_overriding, is_const
+from func left join string q on q.id = func.qual_name_id left join string s on s.id = func.signature_id;
+)sql";
 
-    if (result != SQLITE_OK) {
-        log_error("Error executing query: %s", errmsg);
-        sqlite3_free(errmsg);
+    int result = exec_script(added_tables);
+    if (result == SQLITE_OK) {
+        result = exec_script(sql);
+    }
+    if (result == SQLITE_OK && !deferring_) {
+        result = create_indexes();
     }
 
     return result;
 }
 
+int Database::create_indexes() {
+    int errors = 0;
+
+    for (const auto &key : unique_keys) {
+        MemBuf mb;
+        mb.printf("select count(*) from (select 1 from `%s` group by %s having count(*) > 1)", key.table,
+                  key.columns);
+
+        sqlite3_stmt *stmt;
+        int duplicates = 0;
+        if (sqlite3_prepare_v2(db_, mb.content(), -1, &stmt, nullptr) == SQLITE_OK) {
+            if (sqlite3_step(stmt) == SQLITE_ROW) {
+                duplicates = sqlite3_column_int(stmt, 0);
+            }
+        }
+        sqlite3_finalize(stmt);
+
+        if (duplicates > 0) {
+            log_error("Cannot create %s: %d duplicate keys in %s(%s)", key.name, duplicates, key.table, key.columns);
+            errors++;
+            continue;
+        }
+
+        mb.clear();
+        mb.printf("create unique index if not exists %s on `%s`(%s)", key.name, key.table, key.columns);
+        if (exec_script(mb.content()) != SQLITE_OK) {
+            errors++;
+        }
+    }
+
+    for (const auto &key : lookup_keys) {
+        MemBuf mb;
+        mb.printf("create index if not exists %s on `%s`(%s)", key.name, key.table, key.columns);
+        if (exec_script(mb.content()) != SQLITE_OK) {
+            errors++;
+        }
+    }
+
+    return errors;
+}
+
+void Database::load_caches() {
+    sqlite3_stmt *stmt;
+
+    clear_caches();
+
+    // Rows with a null key are not cached; an insert that hits their unique
+    // key looks them up.
+    auto text = [&stmt](int column) { return (const char *)sqlite3_column_text(stmt, column); };
+
+    if (sqlite3_prepare_v2(db_, "select id, value from string where value is not null", -1, &stmt, nullptr) ==
+        SQLITE_OK) {
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            std::string value = text(1);
+            load_id(RowKey{STRING_TABLE, 0, 0, 0, value}, sqlite3_column_int64(stmt, 0));
+            string_ids_[value] = sqlite3_column_int64(stmt, 0);
+        }
+    }
+    sqlite3_finalize(stmt);
+
+    if (sqlite3_prepare_v2(db_, "select id, path, size, mtime, hash, include_guarded, context, macros "
+                           "from file where path is not null", -1, &stmt, nullptr) == SQLITE_OK) {
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            std::string path = text(1);
+            Id id = sqlite3_column_int64(stmt, 0);
+            load_id(RowKey{FILE_TABLE, 0, 0, 0, path}, id);
+            file_ids_[path] = id;
+
+            FileStamp stamp;
+            stamp.file_id = id;
+            stamp.size = sqlite3_column_int64(stmt, 2);
+            stamp.mtime = sqlite3_column_int64(stmt, 3);
+            stamp.hash = sqlite3_column_int64(stmt, 4);
+            stamp.include_guarded = sqlite3_column_int(stmt, 5);
+            stamp.context = sqlite3_column_int64(stmt, 6);
+            if (text(7)) {
+                stamp.macros = text(7);
+            }
+            if (stamp.hash != 0) {
+                file_stamps_[id] = stamp;
+            }
+        }
+    }
+    sqlite3_finalize(stmt);
+
+    if (sqlite3_prepare_v2(db_,
+                           "select decl.id, s.value, decl.type = '' from decl join string s on s.id = decl.name_id "
+                           "where s.value is not null",
+                           -1, &stmt, nullptr) == SQLITE_OK) {
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            std::string name = text(1);
+            Id id = sqlite3_column_int64(stmt, 0);
+            load_id(RowKey{DECL_TABLE, 0, 0, 0, name}, id);
+            decl_ids_[name] = id;
+            if (sqlite3_column_int(stmt, 2)) {
+                placeholder_decls_.insert(id);
+            }
+        }
+    }
+    sqlite3_finalize(stmt);
+
+    if (sqlite3_prepare_v2(db_,
+                           "select func.id, s.value from func join string s on s.id = func.signature_id "
+                           "where s.value is not null",
+                           -1, &stmt, nullptr) == SQLITE_OK) {
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            std::string signature = text(1);
+            load_id(RowKey{FUNC_TABLE, 0, 0, 0, signature}, sqlite3_column_int64(stmt, 0));
+            func_ids_[signature] = sqlite3_column_int64(stmt, 0);
+        }
+    }
+    sqlite3_finalize(stmt);
+
+    if (sqlite3_prepare_v2(db_,
+                           "select `type`.id, s.value, template_parameter_index from `type` "
+                           "join string s on s.id = `type`.name_id where s.value is not null",
+                           -1, &stmt, nullptr) == SQLITE_OK) {
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            TypeKey key{text(1), sqlite3_column_int(stmt, 2)};
+            load_id(RowKey{TYPE_TABLE, key.template_parameter_index, 0, 0, key.name}, sqlite3_column_int64(stmt, 0));
+            type_ids_[key] = sqlite3_column_int64(stmt, 0);
+        }
+    }
+    sqlite3_finalize(stmt);
+
+    if (sqlite3_prepare_v2(db_, "select id, file_id, end_line, end_column from var_decl", -1, &stmt, nullptr) ==
+        SQLITE_OK) {
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            RowKey key{VAR_DECL_TABLE, sqlite3_column_int64(stmt, 1), sqlite3_column_int(stmt, 2),
+                       sqlite3_column_int(stmt, 3), ""};
+            load_id(key, sqlite3_column_int64(stmt, 0));
+            var_ids_[key] = sqlite3_column_int64(stmt, 0);
+        }
+    }
+    sqlite3_finalize(stmt);
+
+    load_next_ids();
+
+    if (deferring_ || options_.hash_ids) {
+        load_row_keys();
+    }
+}
+
+void Database::load_row_keys() {
+    sqlite3_stmt *stmt;
+
+    // The keys passed to new_row_id() by the insert methods.
+    const struct {
+        Table table;
+        const char *sql;
+    } queries[] = {
+        {TEMPLATE_PARAM_TABLE, "select template_id, template_type = 'class', 0, name, id from template_parameter"},
+        {DECL_BASE_TABLE, "select decl_id, base_id, 0, '', id from decl_base"},
+        {DECL_FIELD_TABLE, "select decl_id, 0, 0, name, id from decl_field"},
+        {ENUM_FIELD_TABLE, "select enum_id, 0, 0, name, id from enum_field"},
+        {TYPE_ARGUMENT_TABLE, "select type_id, `index`, 0, '', id from type_argument"},
+        {FUNC_PARAM_TABLE, "select func_id, position, 0, '', id from func_param"},
+        {METHOD_OVERRIDE_TABLE, "select method_id, overridden_method_id, 0, '', id from method_override"},
+        {VAR_REF_TABLE, "select file_id, end_line, end_column, '', id from var_ref"},
+        {FCALL_TABLE, "select file_id, end_line, end_column, '', id from fcall"},
+        {COMMENT_TABLE, "select owner_id, 0, 0, owner_type, id from comment"},
+    };
+
+    for (const auto &query : queries) {
+        if (sqlite3_prepare_v2(db_, query.sql, -1, &stmt, nullptr) == SQLITE_OK) {
+            while (sqlite3_step(stmt) == SQLITE_ROW) {
+                const char *name = (const char *)sqlite3_column_text(stmt, 3);
+                RowKey key{query.table, sqlite3_column_int64(stmt, 0), sqlite3_column_int64(stmt, 1),
+                           sqlite3_column_int64(stmt, 2), name ? name : ""};
+                if (options_.hash_ids) {
+                    load_id(key, sqlite3_column_int64(stmt, 4));
+                } else {
+                    row_keys_.insert(std::move(key));
+                }
+            }
+        }
+        sqlite3_finalize(stmt);
+    }
+}
+
+void Database::load_id(const RowKey &key, Id id) {
+    if (options_.hash_ids) {
+        hashed_ids_[key.table].emplace(id, RowKeyHash()(key));
+    }
+}
+
+void Database::clear_caches() {
+    string_ids_.clear();
+    file_ids_.clear();
+    decl_ids_.clear();
+    func_ids_.clear();
+    type_ids_.clear();
+    var_ids_.clear();
+    row_keys_.clear();
+    placeholder_decls_.clear();
+    removed_funcs_.clear();
+    file_stamps_.clear();
+    for (auto &ids : hashed_ids_) {
+        ids.clear();
+    }
+    for (auto &id : next_ids_) {
+        id = 0;
+    }
+    keep_caches();
+}
+
+void Database::undo_caches() {
+    string_ids_.undo();
+    file_ids_.undo();
+    decl_ids_.undo();
+    func_ids_.undo();
+    type_ids_.undo();
+    var_ids_.undo();
+    row_keys_.undo();
+    for (auto &ids : hashed_ids_) {
+        ids.undo();
+    }
+    placeholder_decls_.undo();
+    removed_funcs_.undo();
+    file_stamps_.undo();
+}
+
+void Database::keep_caches() {
+    string_ids_.keep();
+    file_ids_.keep();
+    decl_ids_.keep();
+    func_ids_.keep();
+    type_ids_.keep();
+    var_ids_.keep();
+    row_keys_.keep();
+    for (auto &ids : hashed_ids_) {
+        ids.keep();
+    }
+    placeholder_decls_.keep();
+    removed_funcs_.keep();
+    file_stamps_.keep();
+}
+
+bool Database::is_duplicate(RowKey &&key) {
+    return deferring_ && !row_keys_.cache(key);
+}
+
+Id Database::new_id(const RowKey &key) {
+    if (!options_.hash_ids) {
+        return next_id(key.table);
+    }
+
+    Id id = hash_key(key.name, key.a, key.b, key.c);
+    size_t check = RowKeyHash()(key);
+
+    auto &ids = hashed_ids_[key.table];
+    auto it = ids.find(id);
+    if (it != ids.end()) {
+        if (it->second != check) {
+            log_error("Hash id %lld of '%s' is already taken by another row", (long long)id, key.name.c_str());
+            collisions_++;
+        }
+        return 0;
+    }
+
+    ids.cache(id, check);
+    return id;
+}
+
+Id Database::new_row_id(RowKey &&key) {
+    if (options_.hash_ids) {
+        return new_id(key);
+    }
+
+    Table table = key.table;
+    return is_duplicate(std::move(key)) ? 0 : next_id(table);
+}
+
 int Database::clear() {
-    const char *sql = R"sql(
-delete from var_ref;
-delete from var_decl;
-delete from decl_base;
-delete from decl_tree;
-delete from template_parameter;
-delete from type_argument;
-delete from type;
-delete from enum_field;
-delete from decl_field;
-delete from decl;
-delete from file;
-delete from fcall;
-delete from func;
-delete from func_param;
-delete from method_override;
-    )sql";
+    std::lock_guard<std::mutex> lock(mutex_);
+    return call([this]() {
+        // The tables are recreated, so a database written by an older
+        // version gets the current schema. Referencing tables go first, so
+        // dropping a table never cascades.
+        int result = exec_script(R"sql(
+drop view if exists v_decl;
+drop view if exists v_type;
+drop view if exists v_type_argument;
+drop view if exists v_func;
+drop table if exists var_ref;
+drop table if exists fcall;
+drop table if exists method_override;
+drop table if exists func_param;
+drop table if exists template_parameter;
+drop table if exists comment;
+drop table if exists decl_tree;
+drop table if exists decl_base;
+drop table if exists decl_field;
+drop table if exists enum_field;
+drop table if exists var_decl;
+drop table if exists func;
+drop table if exists type_argument;
+drop table if exists type;
+drop table if exists tu_dependency;
+drop table if exists decl;
+drop table if exists file;
+drop table if exists string;
+drop table if exists meta;
+        )sql");
+
+        clear_caches();
+        dirty_decls_.clear();
+
+        if (result == SQLITE_OK) {
+            // Without unique indexes, until finish() builds them, nor foreign
+            // key checks: every id a bulk load refers to was assigned here.
+            deferring_ = options_.defer_indexes;
+            exec_script(deferring_ ? "pragma foreign_keys = off" : "pragma foreign_keys = on");
+            result = create_tables();
+            outdated_ = result != SQLITE_OK;
+        }
 
-    char *errmsg;
-    int result = sqlite3_exec(db_, sql, nullptr, nullptr, &errmsg);
+        return result;
+    });
+}
 
-    if (result != SQLITE_OK) {
-        log_error("Error executing query: %s", errmsg);
-        sqlite3_free(errmsg);
+sqlite3_stmt *Database::prepare(Stmt key, const char *sql) {
+    sqlite3_stmt *&stmt = stmts_[key];
+    if (!stmt) {
+        if (sqlite3_prepare_v3(db_, sql, -1, SQLITE_PREPARE_PERSISTENT, &stmt, nullptr) != SQLITE_OK) {
+            log_error("Error: %s\nQuery was: %s", sqlite3_errmsg(db_), sql);
+            stmt = nullptr;
+        }
     }
+    return stmt;
+}
 
-    return result;
+int Database::exec(sqlite3_stmt *stmt) {
+    if (!stmt) {
+        return -1;
+    }
+
+    int error = sqlite3_step(stmt);
+    if (error != SQLITE_DONE) {
+        log_error("Error: %s (%s)", sqlite3_errmsg(db_), sqlite3_sql(stmt));
+        sqlite3_reset(stmt);
+        return -1;
+    }
+
+    sqlite3_reset(stmt);
+
+    if (in_transaction_ && commit_interval_ > 0 && ++pending_writes_ >= commit_interval_) {
+        commit_batch();
+    }
+
+    return 0;
 }
 
-int Database::get_file_id(const std::string &path) {
-    MemBuf mb;
-    mb.printf("select id from `%s` where `%s` = '%s'", "file", "path", path.c_str());
+int Database::exec_keyed(sqlite3_stmt *stmt) {
+    if (exec(stmt) != 0) {
+        return -1;
+    }
+    return sqlite3_changes(db_) == 0 ? 1 : 0;
+}
 
-    int id = get_int(mb);
-    if (id == 0) {
-        mb.clear();
-        mb.printf("insert into file(path) values('%s')", path.c_str());
-        return exec(mb);
+Id Database::select_id(Stmt key, const char *sql, const std::string &name, int index) {
+    auto stmt = prepare(key, sql);
+    if (!stmt) {
+        return 0;
+    }
+
+    bind(stmt, 1, name, false);
+    if (sqlite3_bind_parameter_count(stmt) > 1) {
+        bind(stmt, 2, index);
     }
 
+    Id id = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : 0;
+    sqlite3_reset(stmt);
     return id;
 }
 
-int Database::update_location(const char *table, int id, Location &location) {
-    MemBuf mb;
+int Database::transaction(Stmt key, const char *sql) {
+    auto stmt = prepare(key, sql);
+    if (!stmt) {
+        return -1;
+    }
 
-    mb.printf("update `%s` set file_id=%d, start_line=%d, end_line=%d, start_column=%d, end_column=%d where id=%d",
-              table, get_file_id(location.file), location.start_line, location.end_line,location.start_column,
-              location.end_column, id);
+    int error = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
 
-    sqlite3_stmt *stmt;
-    sqlite3_prepare_v2(db_, mb.content(), -1, &stmt, nullptr);
-    sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
+    if (error != SQLITE_DONE) {
+        log_error("Error: %s (%s)", sqlite3_errmsg(db_), sql);
+        return -1;
+    }
 
     return 0;
 }
 
-int Database::update_comment(const char *table, int id, Comment &comment) {
-    MemBuf mb;
-    mb.printf("update `%s` set brief_comment=?, comment=? where id=%d", table, id);
+// Counters only move forward: an id handed out but not written may be
+// handed out again, one that another process wrote may not.
+void Database::load_next_ids() {
+    // In the order of Database::Table.
+    const char *tables[TABLE_COUNT] = {
+        "file",      "decl",          "template_parameter", "decl_base",       "decl_field",
+        "enum_field", "type",         "type_argument",      "func",            "func_param",
+        "method_override", "var_decl", "var_ref",           "fcall",              "comment",
+        "string",
+    };
+
+    for (int i = 0; i < TABLE_COUNT; i++) {
+        MemBuf mb;
+        mb.printf("select max(id) from `%s`", tables[i]);
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db_, mb.content(), -1, &stmt, nullptr) == SQLITE_OK) {
+            if (sqlite3_step(stmt) == SQLITE_ROW) {
+                next_ids_[i] = std::max(next_ids_[i], (Id)sqlite3_column_int64(stmt, 0));
+            }
+        }
+        sqlite3_finalize(stmt);
+    }
+}
 
-    sqlite3_stmt *stmt;
-    sqlite3_prepare_v2(db_, mb.content(), -1, &stmt, nullptr);
-    sqlite3_bind_text(stmt, 1, comment.brief.c_str(), -1, SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 2, comment.raw.c_str(), -1, SQLITE_STATIC);
-    sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
+// The write lock is taken when the transaction begins, so the counters
+// reloaded then stay valid until it ends.
+int Database::begin_transaction() {
+    if (in_transaction_) {
+        return 0;
+    }
+    if (transaction(BEGIN, "begin immediate") != 0) {
+        return -1;
+    }
+    in_transaction_ = true;
+    pending_writes_ = 0;
+    if (!options_.hash_ids) {
+        load_next_ids();
+    }
+    keep_caches();
+    std::copy(std::begin(next_ids_), std::end(next_ids_), begin_ids_);
+    return 0;
+}
 
+int Database::commit_transaction() {
+    if (!in_transaction_) {
+        return 0;
+    }
+    if (transaction(COMMIT, "commit") != 0) {
+        return -1;
+    }
+    in_transaction_ = false;
+    keep_caches();
     return 0;
 }
 
-int Database::insert(Decl &decl, bool *inserted) {
-    const auto &location = decl.location;
-    const auto &comment = decl.comment;
-    decl.id = get_decl_id(decl.name, inserted);
+// Unlike commit_transaction(), keeps the undo journal and the counters:
+// exec() may run on the writer thread while the caller's thread adds to them.
+int Database::commit_batch() {
+    if (transaction(COMMIT, "commit") != 0) {
+        return -1;
+    }
+    batch_committed_ = true;
+    if (transaction(BEGIN, "begin immediate") != 0) {
+        in_transaction_ = false;
+        return -1;
+    }
+    pending_writes_ = 0;
+    return 0;
+}
+
+int Database::rollback_transaction() {
+    if (!in_transaction_) {
+        return 0;
+    }
+    in_transaction_ = false;
+    int result = transaction(ROLLBACK, "rollback");
+
+    if (batch_committed_) {
+        // The journal would also bring back the cached ids of rows that
+        // committed batches deleted, so the caches are reloaded instead.
+        // Functions removed by earlier transactions are still to be deleted.
+        std::unordered_set<Id> removed_funcs;
+        removed_funcs.swap(removed_funcs_);
+        load_caches();
+        removed_funcs_.swap(removed_funcs);
+    } else {
+        // Cached ids may point at rows that no longer exist.
+        undo_caches();
+        std::copy(std::begin(begin_ids_), std::end(begin_ids_), next_ids_);
+    }
 
-    MemBuf mb;
+    return result;
+}
 
-    mb << "update decl set " << sql::field("type", decl.type, true) << sql::field("file_id", get_file_id(location.file))
-       << sql::field("start_line", location.start_line) << sql::field("end_line", location.end_line)
-       << sql::field("start_column", location.start_column) << sql::field("end_column", location.end_column)
-       << sql::field("is_struct", decl.is_struct) << sql::field("is_abstract", decl.is_abstract)
-       << sql::field("is_template", decl.is_template) << sql::field("is_scoped", decl.is_scoped)
-       << sql::field("brief_comment", comment.brief) << sql::field("comment", comment.raw)
-       << sql::field("underlying_type", decl.underlying_type) << " where "
-       << sql::field("id", decl.id, true);
+int Database::begin() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    written_files_.clear();
+    return call([this]() {
+        batch_committed_ = false;
+        return begin_transaction();
+    });
+}
 
-    exec(mb);
+int Database::commit() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    written_files_.clear();
+    return call([this]() { return commit_transaction(); });
+}
 
-    return decl.id;
+int Database::rollback() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::unordered_set<Id> files;
+    files.swap(written_files_);
+
+    return call([this, &files]() {
+        int result = rollback_transaction();
+        if (!batch_committed_ || files.empty()) {
+            return result;
+        }
+        batch_committed_ = false;
+
+        if (begin_transaction() != 0) {
+            return -1;
+        }
+
+        int errors = result != 0 ? 1 : 0;
+        auto stmt = prepare(RESET_FILE_STAMP, "update file set hash = null where id = ?");
+        for (Id file_id : files) {
+            errors += remove_rows(file_id);
+            bind(stmt, 1, file_id);
+            errors += exec(stmt) != 0;
+            file_stamps_.uncache(file_id);
+        }
+
+        if (commit_transaction() != 0) {
+            errors++;
+        }
+        return errors;
+    });
 }
 
-int Database::insert(TemplateParam &row) {
-    MemBuf mb;
-    mb << "insert into template_parameter(template_id, template_type, kind, type, name, value, is_variadic, `index`) "
-       "values ("
-       << row.template_id << ", " << sql::str(row.template_type) << "," << sql::str(row.kind) << ", "
-       << sql::str(row.type) << ", " << sql::str(row.name) << ", " << sql::str(row.value) << ", " << row.is_variadic
-       << ", " << row.index << ")";
-    return (row.id = exec(mb));
+int Database::set_meta(const std::string &key, const std::string &value) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return call([this, &key, &value]() {
+        auto stmt = prepare(REPLACE_META, "insert or replace into meta(`key`, value) values (?, ?)");
+        bind(stmt, 1, key, false);
+        bind(stmt, 2, value, false);
+        return exec(stmt);
+    });
 }
 
-int Database::insert(DeclBase &row) {
-    MemBuf mb;
-    mb.printf(
-        "insert into decl_base(decl_id, base_id, position, access) "
-        "values(%d, %d, %d, '%s')",
-        row.decl_id, row.base_id, row.position, row.access.c_str());
-    row.id = exec(mb);
+bool Database::get_meta(const std::string &key, std::string &value) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return call([this, &key, &value]() {
+        auto stmt = prepare(SELECT_META, "select value from meta where `key` = ?");
+        if (!stmt) {
+            return 0;
+        }
+        bind(stmt, 1, key, false);
+        bool found = sqlite3_step(stmt) == SQLITE_ROW;
+        if (found) {
+            auto text = (const char *)sqlite3_column_text(stmt, 0);
+            value = text ? text : "";
+        }
+        sqlite3_reset(stmt);
+        return found ? 1 : 0;
+    }) != 0;
+}
 
-    mb.clear();
+bool Database::get_file_stamp(const std::string &path, FileStamp &stamp) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto id = file_ids_.find(path);
+    if (id == file_ids_.end()) {
+        return false;
+    }
+    auto it = file_stamps_.find(id->second);
+    if (it == file_stamps_.end()) {
+        return false;
+    }
+    stamp = it->second;
+    return true;
+}
 
-    mb.printf(
-        "insert into decl_tree(decl_id, base_id, level) "
-        "values(%d, %d, 1)", row.decl_id, row.base_id);
-    exec(mb);
+int Database::set_dependencies(Id tu_id, const std::vector<FileStamp> &files) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto &file : files) {
+        file_stamps_.cache(file.file_id, file);
+    }
 
-    mb.clear();
+    return call([this, tu_id, &files]() {
+        int errors = 0;
+
+        auto stmt = prepare(UPDATE_FILE_STAMP,
+                            "update file set size = ?, mtime = ?, hash = ?, include_guarded = ?, context = ?, "
+                            "macros = ? where id = ?");
+        for (const auto &file : files) {
+            bind(stmt, 1, (Id)file.size);
+            bind(stmt, 2, (Id)file.mtime);
+            bind(stmt, 3, (Id)file.hash);
+            bind(stmt, 4, file.include_guarded);
+            bind(stmt, 5, (Id)file.context);
+            bind(stmt, 6, file.macros);
+            bind(stmt, 7, file.file_id);
+            errors += exec(stmt) != 0;
+        }
 
-    mb.printf(
-        "insert into decl_tree(decl_id, base_id, level) "
-        "select %d, base_id, level + 1 from decl_tree where decl_id=%d",
-        row.decl_id, row.base_id);
-    exec(mb);
+        stmt = prepare(DELETE_DEPENDENCIES, "delete from tu_dependency where tu_id = ?");
+        bind(stmt, 1, tu_id);
+        errors += exec(stmt) != 0;
 
-    return row.id;
+        stmt = prepare(INSERT_DEPENDENCY, "insert into tu_dependency(tu_id, file_id) values (?, ?)");
+        for (const auto &file : files) {
+            bind(stmt, 1, tu_id);
+            bind(stmt, 2, file.file_id);
+            errors += exec(stmt) != 0;
+        }
+
+        return errors;
+    });
 }
 
-int Database::insert(DeclField &row) {
-    MemBuf mb;
-    mb.printf(
-        "insert into decl_field(decl_id, type_id, name, access) "
-        "values(%d, %d, '%s', '%s')",
-        row.decl_id, row.type_id, row.name.c_str(), row.access.c_str());
+std::vector<std::pair<std::string, FileStamp>> Database::get_dependencies(const std::string &path) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<std::pair<std::string, FileStamp>> files;
 
-    row.id = exec(mb);
+    auto it = file_ids_.find(path);
+    if (it == file_ids_.end()) {
+        return files;
+    }
 
-    update_location("decl_field", row.id, row.location);
-    update_comment("decl_field", row.id, row.comment);
+    Id tu_id = it->second;
+    call([this, tu_id, &files]() {
+        auto stmt = prepare(SELECT_DEPENDENCIES,
+                            "select f.path, f.id, f.size, f.mtime, f.hash, f.include_guarded, f.context, "
+                            "f.macros from tu_dependency d join file f on f.id = d.file_id where d.tu_id = ?");
+        if (!stmt) {
+            return -1;
+        }
+        bind(stmt, 1, tu_id);
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            FileStamp stamp;
+            stamp.file_id = sqlite3_column_int64(stmt, 1);
+            stamp.size = sqlite3_column_int64(stmt, 2);
+            stamp.mtime = sqlite3_column_int64(stmt, 3);
+            stamp.hash = sqlite3_column_int64(stmt, 4);
+            stamp.include_guarded = sqlite3_column_int(stmt, 5);
+            stamp.context = sqlite3_column_int64(stmt, 6);
+            if (auto macros = (const char *)sqlite3_column_text(stmt, 7)) {
+                stamp.macros = macros;
+            }
+            files.emplace_back((const char *)sqlite3_column_text(stmt, 0), stamp);
+        }
+        sqlite3_reset(stmt);
+        return 0;
+    });
 
-    return row.id;
+    return files;
 }
 
-int Database::insert(EnumField &row) {
-    MemBuf mb;
-    mb.printf(
-        "insert into enum_field(enum_id, name, value) "
-        "values(%d, '%s', %d)",
-        row.enum_id, row.name.c_str(), row.value);
+int Database::remove_file_rows(Id file_id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    wrote_file(file_id);
+    return call([this, file_id]() { return remove_rows(file_id); });
+}
 
-    row.id = exec(mb);
+int Database::remove_rows(Id file_id) {
+    sqlite3_stmt *stmt;
+    auto query = [this, file_id, &stmt](const char *sql) {
+        if (sqlite3_prepare_v2(db_, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+            log_error("Error: %s\nQuery was: %s", sqlite3_errmsg(db_), sql);
+            sqlite3_finalize(stmt);
+            return false;
+        }
+        bind(stmt, 1, file_id);
+        return true;
+    };
+
+    // The key caches are updated first: variables are keyed by location
+    // and are forgotten, decls and functions keep their ids.
+    if (query("select id, end_line, end_column from var_decl where file_id = ?1")) {
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            RowKey key{VAR_DECL_TABLE, file_id, sqlite3_column_int(stmt, 1), sqlite3_column_int(stmt, 2), ""};
+            var_ids_.uncache(key);
+            hashed_ids_[VAR_DECL_TABLE].uncache(sqlite3_column_int64(stmt, 0));
+        }
+        sqlite3_finalize(stmt);
+    }
+    if (query("select id from func where file_id = ?1")) {
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            removed_funcs_.cache(sqlite3_column_int64(stmt, 0));
+        }
+        sqlite3_finalize(stmt);
+    }
+    if (query("select id from decl where file_id = ?1 and type != ''")) {
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            placeholder_decls_.cache(sqlite3_column_int64(stmt, 0));
+            dirty_decls_.insert(sqlite3_column_int64(stmt, 0));
+        }
+        sqlite3_finalize(stmt);
+    }
 
-    update_location("enum_field", row.id, row.location);
-    update_comment("enum_field", row.id, row.comment);
+    // Rows owned by the file's decls and functions. Neither is deleted,
+    // since that would cascade to rows in other files: decls are demoted
+    // to placeholders and functions are deleted by finish() unless they
+    // are written again. References to the file's variables go with them.
+    const struct {
+        Table table;
+        const char *name;
+        const char *where;
+    } removals[] = {
+        {COMMENT_TABLE, "comment",
+         "(owner_type = 'decl' and owner_id in (select id from decl where file_id = ?1)) or "
+         "(owner_type = 'func' and owner_id in (select id from func where file_id = ?1)) or "
+         "(owner_type = 'decl_field' and owner_id in (select id from decl_field where file_id = ?1)) or "
+         "(owner_type = 'enum_field' and owner_id in (select id from enum_field where file_id = ?1))"},
+        {DECL_BASE_TABLE, "decl_base", "decl_id in (select id from decl where file_id = ?1)"},
+        {TEMPLATE_PARAM_TABLE, "template_parameter",
+         "(template_type = 'class' and template_id in (select id from decl where file_id = ?1)) or "
+         "(template_type = 'function' and template_id in (select id from func where file_id = ?1))"},
+        {FUNC_PARAM_TABLE, "func_param", "func_id in (select id from func where file_id = ?1)"},
+        {METHOD_OVERRIDE_TABLE, "method_override", "method_id in (select id from func where file_id = ?1)"},
+        {DECL_FIELD_TABLE, "decl_field", "file_id = ?1"},
+        {ENUM_FIELD_TABLE, "enum_field", "file_id = ?1"},
+        {VAR_REF_TABLE, "var_ref", "file_id = ?1 or var_id in (select id from var_decl where file_id = ?1)"},
+        {FCALL_TABLE, "fcall", "file_id = ?1"},
+        {VAR_DECL_TABLE, "var_decl", "file_id = ?1"},
+    };
+
+    int errors = 0;
+    for (const auto &removal : removals) {
+        MemBuf mb;
+        if (options_.hash_ids) {
+            // Rows written again get their old ids back.
+            mb.printf("select id from `%s` where %s", removal.name, removal.where);
+            if (query(mb.content())) {
+                while (sqlite3_step(stmt) == SQLITE_ROW) {
+                    hashed_ids_[removal.table].uncache(sqlite3_column_int64(stmt, 0));
+                }
+                sqlite3_finalize(stmt);
+            }
+            mb.clear();
+        }
 
-    return row.id;
+        mb.printf("delete from `%s` where %s", removal.name, removal.where);
+        if (query(mb.content())) {
+            errors += sqlite3_step(stmt) != SQLITE_DONE;
+            sqlite3_finalize(stmt);
+        }
+    }
+
+    if (query("update decl set type = '', file_id = null, start_line = null, end_line = null, "
+              "start_column = null, end_column = null, underlying_type = null, is_struct = false, "
+              "is_abstract = false, is_template = false, is_scoped = false where file_id = ?1")) {
+        errors += sqlite3_step(stmt) != SQLITE_DONE;
+        sqlite3_finalize(stmt);
+    }
+
+    if (errors > 0) {
+        log_error("Failed to remove the rows of file %lld: %s", (long long)file_id, sqlite3_errmsg(db_));
+    }
+    return errors;
 }
 
-int Database::exec(const MemBuf &mb) {
+// The rows that cascade away with a file, as subqueries on its id (?1).
+#define FILE_DECLS "(select id from decl where file_id = ?1)"
+#define FILE_FUNCS "(select id from func where file_id = ?1 or decl_id in " FILE_DECLS ")"
+#define FILE_VARS "(select id from var_decl where file_id = ?1 or class_id in " FILE_DECLS ")"
+#define FILE_DECL_FIELDS "(select id from decl_field where file_id = ?1 or decl_id in " FILE_DECLS ")"
+#define FILE_ENUM_FIELDS "(select id from enum_field where file_id = ?1 or enum_id in " FILE_DECLS ")"
+
+void Database::forget_file_rows(Id file_id) {
     sqlite3_stmt *stmt;
+    auto query = [this, file_id, &stmt](const char *sql) {
+        if (sqlite3_prepare_v2(db_, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+            log_error("Error: %s\nQuery was: %s", sqlite3_errmsg(db_), sql);
+            sqlite3_finalize(stmt);
+            return false;
+        }
+        bind(stmt, 1, file_id);
+        return true;
+    };
+
+    if (query("select decl.id, s.value from decl join string s on s.id = decl.name_id where decl.file_id = ?1")) {
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            Id id = sqlite3_column_int64(stmt, 0);
+            decl_ids_.uncache((const char *)sqlite3_column_text(stmt, 1));
+            placeholder_decls_.uncache(id);
+            hashed_ids_[DECL_TABLE].uncache(id);
+        }
+        sqlite3_finalize(stmt);
+    }
+    if (query("select func.id, s.value from func left join string s on s.id = func.signature_id "
+              "where func.id in " FILE_FUNCS)) {
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            Id id = sqlite3_column_int64(stmt, 0);
+            if (auto signature = (const char *)sqlite3_column_text(stmt, 1)) {
+                func_ids_.uncache(signature);
+            }
+            removed_funcs_.uncache(id);
+            hashed_ids_[FUNC_TABLE].uncache(id);
+        }
+        sqlite3_finalize(stmt);
+    }
+    if (query("select id, file_id, end_line, end_column from var_decl where id in " FILE_VARS)) {
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            var_ids_.uncache(RowKey{VAR_DECL_TABLE, sqlite3_column_int64(stmt, 1), sqlite3_column_int(stmt, 2),
+                                     sqlite3_column_int(stmt, 3), ""});
+            hashed_ids_[VAR_DECL_TABLE].uncache(sqlite3_column_int64(stmt, 0));
+        }
+        sqlite3_finalize(stmt);
+    }
+    file_stamps_.uncache(file_id);
+    hashed_ids_[FILE_TABLE].uncache(file_id);
 
-    int error = sqlite3_prepare_v2(db_, mb.content(), -1, &stmt, nullptr);
-    if (error != SQLITE_OK) {
-        log_error("Error: %s\nQuery was: %s", sqlite3_errmsg(db_), mb.content());
-        return -1;
+    if (!options_.hash_ids) {
+        return;
     }
 
-    if ((error = sqlite3_step(stmt)) != SQLITE_DONE) {
-        log_error("Error: %s (%s)", sqlite3_errstr(error), mb.content());
-        return -1;
+    // The other tables are only keyed by their hash ids.
+    const struct {
+        Table table;
+        const char *sql;
+    } cascades[] = {
+        {TEMPLATE_PARAM_TABLE,
+         "select id from template_parameter where (template_type = 'class' and template_id in " FILE_DECLS
+         ") or (template_type = 'function' and template_id in " FILE_FUNCS ")"},
+        {DECL_BASE_TABLE, "select id from decl_base where decl_id in " FILE_DECLS " or base_id in " FILE_DECLS},
+        {DECL_FIELD_TABLE, "select id from decl_field where id in " FILE_DECL_FIELDS},
+        {ENUM_FIELD_TABLE, "select id from enum_field where id in " FILE_ENUM_FIELDS},
+        {FUNC_PARAM_TABLE, "select id from func_param where func_id in " FILE_FUNCS},
+        {METHOD_OVERRIDE_TABLE,
+         "select id from method_override where method_id in " FILE_FUNCS " or overridden_method_id in " FILE_FUNCS},
+        {VAR_REF_TABLE, "select id from var_ref where file_id = ?1 or var_id in " FILE_VARS},
+        {FCALL_TABLE, "select id from fcall where file_id = ?1 or func_id in " FILE_FUNCS},
+        {COMMENT_TABLE,
+         "select id from comment where (owner_type = 'decl' and owner_id in " FILE_DECLS
+         ") or (owner_type = 'func' and owner_id in " FILE_FUNCS
+         ") or (owner_type = 'decl_field' and owner_id in " FILE_DECL_FIELDS
+         ") or (owner_type = 'enum_field' and owner_id in " FILE_ENUM_FIELDS ")"},
+    };
+
+    for (const auto &cascade : cascades) {
+        if (query(cascade.sql)) {
+            while (sqlite3_step(stmt) == SQLITE_ROW) {
+                hashed_ids_[cascade.table].uncache(sqlite3_column_int64(stmt, 0));
+            }
+            sqlite3_finalize(stmt);
+        }
+    }
+}
+
+#undef FILE_DECLS
+#undef FILE_FUNCS
+#undef FILE_VARS
+#undef FILE_DECL_FIELDS
+#undef FILE_ENUM_FIELDS
+
+int Database::remove_file(const std::string &path) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = file_ids_.find(path);
+    if (it == file_ids_.end()) {
+        return 0;
     }
 
-    long long last_id = sqlite3_last_insert_rowid(db_);
+    Id file_id = it->second;
+    return call([this, file_id, &path]() {
+        bool own_transaction = !in_transaction_;
+        if (own_transaction && begin_transaction() != 0) {
+            return -1;
+        }
 
-    sqlite3_finalize(stmt);
+        // Classes deriving from the file's decls lose ancestors.
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db_, "select distinct decl_id from decl_base where base_id in "
+                                    "(select id from decl where file_id = ?)", -1, &stmt, nullptr) == SQLITE_OK) {
+            bind(stmt, 1, file_id);
+            while (sqlite3_step(stmt) == SQLITE_ROW) {
+                dirty_decls_.insert(sqlite3_column_int64(stmt, 0));
+            }
+        }
+        sqlite3_finalize(stmt);
+
+        forget_file_rows(file_id);
+
+        // Everything else that refers to the file, directly or through its
+        // decls, functions and variables, goes with it.
+        stmt = prepare(DELETE_FILE, "delete from `file` where id = ?");
+        bind(stmt, 1, file_id);
+        if (exec(stmt) != 0) {
+            log_error("Failed to remove %s", path.c_str());
+            // Forgotten ids are only looked up again; the rollback of the
+            // enclosing transaction restores them.
+            if (own_transaction) {
+                rollback_transaction();
+            }
+            return -1;
+        }
+        file_ids_.uncache(path);
 
-    return (int)last_id;
+        if (own_transaction && commit_transaction() != 0) {
+            return -1;
+        }
+        return 0;
+    });
 }
 
-int Database::get_int(const MemBuf &mb) {
-    sqlite3_stmt *stmt;
+// Prefixes each column in a unique_keys column list with `alias`.
+static std::string qualify(const char *alias, const char *columns) {
+    std::string result = std::string(alias) + ".";
+    for (const char *c = columns; *c; c++) {
+        result += *c;
+        if (*c == ' ') {
+            result += std::string(alias) + ".";
+        }
+    }
+    return result;
+}
 
-    sqlite3_prepare_v2(db_, mb.content(), -1, &stmt, nullptr);
+int Database::copy_rows(const std::string &path) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return call([this, &path]() {
+        if (in_transaction_) {
+            log_error("Cannot copy rows from %s within a transaction", path.c_str());
+            return -1;
+        }
 
-    int id = 0;
-    if (sqlite3_step(stmt) == SQLITE_ROW) {
-        id = (int)sqlite3_column_int64(stmt, 0);
+        sqlite3_stmt *stmt;
+        int result = sqlite3_prepare_v2(db_, "attach database ? as shard", -1, &stmt, nullptr);
+        if (result == SQLITE_OK) {
+            bind(stmt, 1, path, false);
+            result = sqlite3_step(stmt);
+        }
+        sqlite3_finalize(stmt);
+        if (result != SQLITE_DONE) {
+            log_error("Failed to attach %s: %s", path.c_str(), sqlite3_errmsg(db_));
+            return -1;
+        }
+
+        int errors = begin_transaction() != 0 ? 1 : 0;
+
+        // Ids are hashes of the unique keys, so a row that exists in both
+        // databases has the same id in both and is skipped.
+        for (const auto &key : unique_keys) {
+            if (errors > 0) {
+                break;
+            }
+            if (strcmp(key.table, "decl_tree") == 0) {
+                continue;  // rebuilt by finish()
+            }
+            if (strcmp(key.table, "tu_dependency") == 0) {
+                // Not hashed: the rows are replaced whenever a TU is indexed.
+                // With deferred indexes, nothing rejects a row that is already
+                // there, so those are left out by their key.
+                if (exec_script("insert into main.tu_dependency(tu_id, file_id) "
+                                "select tu_id, file_id from shard.tu_dependency "
+                                "except select tu_id, file_id from main.tu_dependency") != SQLITE_OK) {
+                    errors++;
+                }
+                continue;
+            }
+
+            MemBuf mb;
+            mb.printf("select count(*) from shard.`%s` s join main.`%s` m on m.id = s.id where (%s) is not (%s)",
+                      key.table, key.table, qualify("s", key.columns).c_str(), qualify("m", key.columns).c_str());
+
+            int collisions = -1;
+            if (sqlite3_prepare_v2(db_, mb.content(), -1, &stmt, nullptr) == SQLITE_OK) {
+                if (sqlite3_step(stmt) == SQLITE_ROW) {
+                    collisions = sqlite3_column_int(stmt, 0);
+                }
+            }
+            sqlite3_finalize(stmt);
+
+            if (collisions != 0) {
+                log_error("%s: %d ids in %s collide with other rows", path.c_str(), collisions, key.table);
+                errors++;
+                break;
+            }
+
+            mb.clear();
+            if (strcmp(key.table, "decl") == 0) {
+                // A placeholder row from get_decl_id() takes the other
+                // database's definition of the decl.
+                mb.printf(
+                    "insert into decl select * from shard.decl where true on conflict(id) do update set "
+                    "type=excluded.type, file_id=excluded.file_id, start_line=excluded.start_line, "
+                    "end_line=excluded.end_line, start_column=excluded.start_column, end_column=excluded.end_column, "
+                    "underlying_type=excluded.underlying_type, is_struct=excluded.is_struct, "
+                    "is_abstract=excluded.is_abstract, is_template=excluded.is_template, is_scoped=excluded.is_scoped "
+                    "where decl.type = '' and excluded.type != ''");
+            } else {
+                mb.printf("insert or ignore into main.`%s` select * from shard.`%s`", key.table, key.table);
+            }
+            if (exec_script(mb.content()) != SQLITE_OK) {
+                errors++;
+            }
+        }
+
+        if (errors == 0 &&
+            sqlite3_prepare_v2(db_, "select distinct decl_id from shard.decl_base", -1, &stmt, nullptr) == SQLITE_OK) {
+            while (sqlite3_step(stmt) == SQLITE_ROW) {
+                dirty_decls_.insert(sqlite3_column_int64(stmt, 0));
+            }
+            sqlite3_finalize(stmt);
+        }
+
+        if (errors > 0) {
+            rollback_transaction();
+        } else if (commit_transaction() != 0) {
+            errors++;
+        }
+
+        exec_script("detach database shard");
+        return errors;
+    });
+}
+
+template <class Row, class Fn, class Select>
+Id Database::write_keyed(Table table, Id id, const Row &row, Fn fn, Select select) {
+    if (writer_.joinable()) {
+        queue_.push([row, fn, id]() {
+            if (fn(row) > 0) {
+                log_error("Row %lld was not written: its key is taken by another row", (long long)id);
+            }
+        });
+        return id;
     }
 
-    sqlite3_finalize(stmt);
+    int result = fn(row);
+    if (result > 0) {
+        return select();
+    }
+    if (result < 0) {
+        // Nothing refers to the id yet; the row can be written again later.
+        hashed_ids_[table].uncache(id);
+        return 0;
+    }
+    return id;
+}
+
+Id Database::intern(const std::string &value, bool use_null_for_empty) {
+    if (value.empty() && use_null_for_empty) {
+        return 0;
+    }
+
+    auto it = string_ids_.find(value);
+    if (it != string_ids_.end()) {
+        return it->second;
+    }
+
+    Id id = new_id(RowKey{STRING_TABLE, 0, 0, 0, value});
+    if (id == 0) {
+        return 0;
+    }
+
+    id = write_keyed(
+        STRING_TABLE, id, value,
+        [this, id](const std::string &value) {
+            auto stmt = prepare(INSERT_STRING, "insert into string(id, value) values(?, ?) on conflict do nothing");
+            bind(stmt, 1, id);
+            bind(stmt, 2, value, false);
+            return exec_keyed(stmt);
+        },
+        [this, &value]() { return select_id(SELECT_STRING_ID, "select id from string where value = ?1", value); });
+    if (id != 0) {
+        string_ids_.cache(value, id);
+    }
 
     return id;
 }
 
-int Database::get_decl_id(const std::string &name, bool *inserted) {
-    MemBuf mb;
-    mb.printf("select id from decl where name = '%s'", name.c_str());
-    int id = get_int(mb);
+Id Database::get_file_id(const std::string &path) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (path.empty()) {
+        return 0;
+    }
+
+    auto it = file_ids_.find(path);
+    if (it != file_ids_.end()) {
+        return it->second;
+    }
+
+    Id id = new_id(RowKey{FILE_TABLE, 0, 0, 0, path});
     if (id == 0) {
-        mb.clear();
-        mb.printf("insert into decl(type, name, is_scoped) values ('', '%s', false)", name.c_str());
+        return 0;
+    }
+
+    id = write_keyed(
+        FILE_TABLE, id, path,
+        [this, id](const std::string &path) {
+            auto stmt = prepare(INSERT_FILE, "insert into file(id, path) values(?, ?) on conflict do nothing");
+            bind(stmt, 1, id);
+            bind(stmt, 2, path, false);
+            return exec_keyed(stmt);
+        },
+        [this, &path]() { return select_id(SELECT_FILE_ID, "select id from file where path = ?1", path); });
+    if (id != 0) {
+        file_ids_.cache(path, id);
+    }
+
+    return id;
+}
+
+// Shared by insert(Decl) and get_decl_id(), which prepare it under one Stmt.
+#define SELECT_DECL_ID_SQL "select id from decl where name_id = (select id from string where value = ?1)"
+
+Id Database::insert(Decl &decl, bool *inserted) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // A decl may already exist as a placeholder row inserted by get_decl_id();
+    // either way the row is written with a single statement.
+    auto it = decl_ids_.find(decl.name);
+    bool exists = it != decl_ids_.end();
+
+    if (exists) {
+        decl.id = it->second;
+        if (placeholder_decls_.uncache(decl.id) && inserted) {
+            *inserted = true;
+        }
+    } else {
+        decl.id = new_id(RowKey{DECL_TABLE, 0, 0, 0, decl.name});
+        if (decl.id == 0) {
+            return 0;
+        }
+    }
+
+    Id name_id = exists ? 0 : intern(decl.name, false);
+
+    auto write_decl = [this, name_id](const Decl &decl, bool exists) {
+        sqlite3_stmt *stmt;
+        if (exists) {
+            stmt = prepare(UPDATE_DECL,
+                           "update decl set type=?1, file_id=?2, start_line=?3, end_line=?4, start_column=?5, "
+                           "end_column=?6, is_struct=?7, is_abstract=?8, is_template=?9, is_scoped=?10, "
+                           "underlying_type=?11 where id=?12");
+        } else {
+            stmt = prepare(INSERT_DECL_ROW,
+                           "insert into decl(type, file_id, start_line, end_line, start_column, end_column, "
+                           "is_struct, is_abstract, is_template, is_scoped, underlying_type, id, name_id) "
+                           "values (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10, ?11, ?12, ?13) on conflict do nothing");
+            bind_pk(stmt, 13, name_id);
+        }
+
+        bind(stmt, 1, decl.type);
+        bind_pk(stmt, 2, decl.location.file_id);
+        bind_location(stmt, 3, decl.location);
+        bind(stmt, 7, decl.is_struct);
+        bind(stmt, 8, decl.is_abstract);
+        bind(stmt, 9, decl.is_template);
+        bind(stmt, 10, decl.is_scoped);
+        bind(stmt, 11, decl.underlying_type);
+        bind(stmt, 12, decl.id);
+        return exists ? exec(stmt) : exec_keyed(stmt);
+    };
+
+    if (exists) {
+        write(decl, [write_decl](const Decl &decl) { write_decl(decl, true); });
+    } else {
+        Id id = write_keyed(
+            DECL_TABLE, decl.id, decl, [write_decl](const Decl &decl) { return write_decl(decl, false); },
+            [this, &decl]() { return select_id(SELECT_DECL_ID, SELECT_DECL_ID_SQL, decl.name); });
+        if (id == 0) {
+            return 0;
+        }
+        if (id != decl.id) {
+            // The name already has a row: it takes this definition.
+            decl.id = id;
+            write_decl(decl, true);
+        }
+        decl_ids_.cache(decl.name, decl.id);
         if (inserted) {
             *inserted = true;
         }
-        return exec(mb);
     }
-    return id;
+
+    wrote_file(decl.location.file_id);
+    insert_comment("decl", decl.id, decl.comment);
+
+    return decl.id;
 }
 
-int Database::get_func_id(const std::string &signature) {
-    MemBuf mb;
-    mb.printf("select id from func where signature = '%s'", signature.c_str());
-    return get_int(mb);
+void Database::insert_comment(const char *owner_type, Id owner_id, const Comment &comment) {
+    if (owner_id <= 0 || (comment.brief.empty() && comment.raw.empty())) {
+        return;
+    }
+
+    Id id = new_row_id(RowKey{COMMENT_TABLE, owner_id, 0, 0, owner_type});
+    if (id == 0) {
+        return;
+    }
+
+    CommentRow row{id, owner_type, owner_id, comment};
+
+    write(row, [this](const CommentRow &row) {
+        auto stmt = prepare(INSERT_COMMENT,
+                            "insert or ignore into comment(id, owner_type, owner_id, brief_comment, comment) "
+                            "values (?, ?, ?, ?, ?)");
+        bind(stmt, 1, row.id);
+        bind(stmt, 2, row.owner_type);
+        bind(stmt, 3, row.owner_id);
+        bind(stmt, 4, row.comment.brief);
+        bind(stmt, 5, row.comment.raw);
+        exec(stmt);
+    });
 }
 
-int Database::get_type_id(const std::string &qual_name) {
-    MemBuf mb;
-    mb.printf("select id from `type` where qual_name = '%s'", qual_name.c_str());
-    return get_int(mb);
+Id Database::insert(TemplateParam &row) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    row.id = new_row_id(RowKey{TEMPLATE_PARAM_TABLE, row.template_id, row.template_type == "class", 0, row.name});
+    if (row.id == 0) {
+        return 0;
+    }
+
+    write(row, [this](const TemplateParam &row) {
+        auto stmt = prepare(INSERT_TEMPLATE_PARAM,
+                            "insert into template_parameter(id, template_id, template_type, kind, type, name, value, "
+                            "is_variadic, `index`) values (?, ?, ?, ?, ?, ?, ?, ?, ?)");
+        bind(stmt, 1, row.id);
+        bind(stmt, 2, row.template_id);
+        bind(stmt, 3, row.template_type);
+        bind(stmt, 4, row.kind);
+        bind(stmt, 5, row.type);
+        bind(stmt, 6, row.name);
+        bind(stmt, 7, row.value);
+        bind(stmt, 8, row.is_variadic);
+        bind(stmt, 9, row.index);
+        exec(stmt);
+    });
+
+    return row.id;
 }
 
-int Database::get_var_id(const std::string &file, int end_line, int end_column) {
-    MemBuf mb;
-    mb.printf("select id from var_decl where file_id=%d and end_line=%d and end_column=%d", get_file_id(file), end_line,
-              end_column);
-    return get_int(mb);
+Id Database::insert(DeclBase &row) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    row.id = new_row_id(RowKey{DECL_BASE_TABLE, row.decl_id, row.base_id, 0, ""});
+    if (row.id == 0) {
+        return 0;
+    }
+    dirty_decls_.insert(row.decl_id);
+
+    write(row, [this](const DeclBase &row) {
+        auto stmt = prepare(INSERT_DECL_BASE,
+                            "insert into decl_base(id, decl_id, base_id, position, access) values(?, ?, ?, ?, ?)");
+        bind(stmt, 1, row.id);
+        bind_pk(stmt, 2, row.decl_id);
+        bind_pk(stmt, 3, row.base_id);
+        bind(stmt, 4, row.position);
+        bind(stmt, 5, row.access, false);
+        exec(stmt);
+    });
+
+    return row.id;
+}
+
+Id Database::insert(DeclField &row) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    row.id = new_row_id(RowKey{DECL_FIELD_TABLE, row.decl_id, 0, 0, row.name});
+    if (row.id == 0) {
+        return 0;
+    }
+
+    wrote_file(row.location.file_id);
+    write(row, [this](const DeclField &row) {
+        auto stmt = prepare(INSERT_DECL_FIELD,
+                            "insert into decl_field(id, decl_id, type_id, name, access, file_id, start_line, "
+                            "end_line, start_column, end_column) values(?, ?, ?, ?, ?, ?, ?, ?, ?, ?)");
+        bind(stmt, 1, row.id);
+        bind_pk(stmt, 2, row.decl_id);
+        bind_pk(stmt, 3, row.type_id);
+        bind(stmt, 4, row.name, false);
+        bind(stmt, 5, row.access, false);
+        bind_pk(stmt, 6, row.location.file_id);
+        bind_location(stmt, 7, row.location);
+        exec(stmt);
+    });
+
+    insert_comment("decl_field", row.id, row.comment);
+
+    return row.id;
 }
 
-int Database::insert(Type &row, bool *inserted) {
-    MemBuf mb;
-    mb.printf("select id from `type` where `name` = '%s' and template_parameter_index = %d", row.name.c_str(),
-              row.template_parameter_index);
+Id Database::insert(EnumField &row) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    row.id = new_row_id(RowKey{ENUM_FIELD_TABLE, row.enum_id, 0, 0, row.name});
+    if (row.id == 0) {
+        return 0;
+    }
+
+    wrote_file(row.location.file_id);
+    write(row, [this](const EnumField &row) {
+        auto stmt = prepare(INSERT_ENUM_FIELD,
+                            "insert into enum_field(id, enum_id, name, value, file_id, start_line, end_line, "
+                            "start_column, end_column) values(?, ?, ?, ?, ?, ?, ?, ?, ?)");
+        bind(stmt, 1, row.id);
+        bind_pk(stmt, 2, row.enum_id);
+        bind(stmt, 3, row.name, false);
+        bind(stmt, 4, row.value);
+        bind_pk(stmt, 5, row.location.file_id);
+        bind_location(stmt, 6, row.location);
+        exec(stmt);
+    });
+
+    insert_comment("enum_field", row.id, row.comment);
 
-    int id = get_int(mb);
+    return row.id;
+}
+
+Id Database::get_decl_id(const std::string &name, bool *inserted) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = decl_ids_.find(name);
+    if (it != decl_ids_.end()) {
+        return it->second;
+    }
 
+    Id placeholder_id = new_id(RowKey{DECL_TABLE, 0, 0, 0, name});
+    if (placeholder_id == 0) {
+        return 0;
+    }
+
+    Id id = write_keyed(
+        DECL_TABLE, placeholder_id, intern(name, false),
+        [this, placeholder_id](Id name_id) {
+            auto stmt = prepare(INSERT_DECL, "insert into decl(id, type, name_id, is_scoped) values (?, '', ?, false) "
+                                             "on conflict do nothing");
+            bind(stmt, 1, placeholder_id);
+            bind_pk(stmt, 2, name_id);
+            return exec_keyed(stmt);
+        },
+        [this, &name]() { return select_id(SELECT_DECL_ID, SELECT_DECL_ID_SQL, name); });
     if (id == 0) {
-        mb.clear();
-        mb << "insert into type(name, decl_name, decl_kind, indirection, "
-           << "template_parameter_index) values (" << sql::str(row.name) << ", " << sql::str(row.decl_name) << ", "
-           << sql::str(row.decl_kind) << "," << sql::str(row.indirection, false) << "," << row.template_parameter_index
-           << ")";
-        id = exec(mb);
+        return 0;
+    }
+
+    decl_ids_.cache(name, id);
+    if (id == placeholder_id) {
+        placeholder_decls_.cache(id);
         if (inserted) {
             *inserted = true;
         }
     }
 
-    return (row.id = id);
+    return id;
 }
 
-int Database::insert(TypeArgument &row) {
-    MemBuf mb;
-    mb << "insert into type_argument(type_id, kind, value, `index`, referenced_type_id) "
-       << "values (" << row.type_id << ", " << sql::str(row.kind) << ", " << sql::str(row.value) << ", "
-       << row.index << "," << sql::pk(row.referenced_type_id) << ")";
-    row.id = exec(mb);
-    if (row.id <= 0) {
-        log_error("Failed to insert template argument");
+#undef SELECT_DECL_ID_SQL
+
+Id Database::get_func_id(const std::string &signature) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = func_ids_.find(signature);
+    return it != func_ids_.end() ? it->second : 0;
+}
+
+Id Database::get_type_id(const std::string &name) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = type_ids_.find(TypeKey{name, -1});
+    return it != type_ids_.end() ? it->second : 0;
+}
+
+Id Database::get_var_id(Id file_id, int end_line, int end_column) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = var_ids_.find(RowKey{VAR_DECL_TABLE, file_id, end_line, end_column, ""});
+    return it != var_ids_.end() ? it->second : 0;
+}
+
+Id Database::insert(Type &row, bool *inserted) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    TypeKey key{row.name, row.template_parameter_index};
+
+    auto it = type_ids_.find(key);
+    if (it != type_ids_.end()) {
+        return (row.id = it->second);
     }
+
+    row.id = new_id(RowKey{TYPE_TABLE, row.template_parameter_index, 0, 0, row.name});
+    if (row.id == 0) {
+        return 0;
+    }
+    Id assigned = row.id;
+
+    Id name_id = intern(row.name);
+    Id decl_name_id = intern(row.decl_name);
+
+    row.id = write_keyed(
+        TYPE_TABLE, assigned, row,
+        [this, name_id, decl_name_id](const Type &row) {
+            auto stmt = prepare(INSERT_TYPE,
+                                "insert into type(id, name_id, decl_name_id, decl_kind, indirection, "
+                                "template_parameter_index) values (?, ?, ?, ?, ?, ?) on conflict do nothing");
+            bind(stmt, 1, row.id);
+            bind_pk(stmt, 2, name_id);
+            bind_pk(stmt, 3, decl_name_id);
+            bind(stmt, 4, row.decl_kind);
+            bind(stmt, 5, row.indirection, false);
+            bind(stmt, 6, row.template_parameter_index);
+            return exec_keyed(stmt);
+        },
+        [this, &row]() {
+            return select_id(SELECT_TYPE_ID,
+                             "select id from `type` where name_id = (select id from string where value = ?1) "
+                             "and template_parameter_index = ?2",
+                             row.name, row.template_parameter_index);
+        });
+    if (row.id == 0) {
+        return 0;
+    }
+
+    type_ids_.cache(key, row.id);
+    if (inserted && row.id == assigned) {
+        *inserted = true;
+    }
+
     return row.id;
 }
 
-int Database::insert(Function &row) {
-    MemBuf mb;
-    mb << "insert into func(name, qual_name, signature, decl_id, type_id, access, is_static, is_inline, "
-       << "is_virtual, is_pure, is_ctor, is_overriding, is_const) values (" << sql::str(row.name) << ", "
-       << sql::str(row.qual_name) << ", " << sql::str(row.signature) << ", " << sql::pk(row.decl_id) << ", "
-       << sql::pk(row.type_id) << "," << sql::str(row.access) << ", " << row.is_static << ", " << row.is_inline << ", "
-       << row.is_virtual << ", " << row.is_pure << ", " << row.is_ctor << ", " << row.is_overriding << ", "
-       << row.is_const << ")";
-    row.id = exec(mb);
-    update_location("func", row.id, row.location);
-    update_comment("func", row.id, row.comment);
+Id Database::insert(TypeArgument &row) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    row.id = new_row_id(RowKey{TYPE_ARGUMENT_TABLE, row.type_id, row.index, 0, ""});
+    if (row.id == 0) {
+        return 0;
+    }
+
+    Id value_id = intern(row.value);
+
+    write(row, [this, value_id](const TypeArgument &row) {
+        auto stmt = prepare(INSERT_TYPE_ARGUMENT,
+                            "insert into type_argument(id, type_id, kind, value_id, `index`, referenced_type_id) "
+                            "values (?, ?, ?, ?, ?, ?)");
+        bind(stmt, 1, row.id);
+        bind_pk(stmt, 2, row.type_id);
+        bind(stmt, 3, row.kind);
+        bind_pk(stmt, 4, value_id);
+        bind(stmt, 5, row.index);
+        bind_pk(stmt, 6, row.referenced_type_id);
+        if (exec(stmt) != 0) {
+            log_error("Failed to insert template argument");
+        }
+    });
+
     return row.id;
 }
 
-int Database::insert(FunctionParam &row) {
-    MemBuf mb;
-    mb << "insert into func_param(func_id, position, type_id, name, default_value) values (" << row.function_id << ","
-       << row.position << "," << row.type_id << "," << sql::str(row.name) << ", " << sql::str(row.default_value) << ")";
-    return (row.id = exec(mb));
+Id Database::insert(Function &row, bool *inserted) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // The function may have been written by an earlier translation unit or
+    // another thread. The row of one removed with its file is overwritten.
+    auto it = func_ids_.find(row.signature);
+    bool removed = false;
+    if (it != func_ids_.end()) {
+        row.id = it->second;
+        removed = removed_funcs_.uncache(row.id);
+        if (!removed) {
+            return row.id;
+        }
+    } else {
+        row.id = new_id(RowKey{FUNC_TABLE, 0, 0, 0, row.signature});
+        if (row.id == 0) {
+            return 0;
+        }
+    }
+
+    Id qual_name_id = intern(row.qual_name);
+    Id signature_id = intern(row.signature);
+
+    auto write_func = [this, removed, qual_name_id, signature_id](const Function &row) {
+        sqlite3_stmt *stmt;
+        if (removed) {
+            stmt = prepare(UPDATE_FUNC,
+                           "update func set name=?2, qual_name_id=?3, signature_id=?4, decl_id=?5, type_id=?6, "
+                           "access=?7, is_static=?8, is_inline=?9, is_virtual=?10, is_pure=?11, is_ctor=?12, "
+                           "is_overriding=?13, is_const=?14, file_id=?15, start_line=?16, end_line=?17, "
+                           "start_column=?18, end_column=?19 where id=?1");
+        } else {
+            stmt = prepare(INSERT_FUNC,
+                           "insert into func(id, name, qual_name_id, signature_id, decl_id, type_id, access, "
+                           "is_static, is_inline, is_virtual, is_pure, is_ctor, is_overriding, is_const, file_id, "
+                           "start_line, end_line, start_column, end_column) "
+                           "values (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?) on conflict do nothing");
+        }
+        bind(stmt, 1, row.id);
+        bind(stmt, 2, row.name);
+        bind_pk(stmt, 3, qual_name_id);
+        bind_pk(stmt, 4, signature_id);
+        bind_pk(stmt, 5, row.decl_id);
+        bind_pk(stmt, 6, row.type_id);
+        bind(stmt, 7, row.access);
+        bind(stmt, 8, row.is_static);
+        bind(stmt, 9, row.is_inline);
+        bind(stmt, 10, row.is_virtual);
+        bind(stmt, 11, row.is_pure);
+        bind(stmt, 12, row.is_ctor);
+        bind(stmt, 13, row.is_overriding);
+        bind(stmt, 14, row.is_const);
+        bind_pk(stmt, 15, row.location.file_id);
+        bind_location(stmt, 16, row.location);
+        return removed ? exec(stmt) : exec_keyed(stmt);
+    };
+
+    if (removed) {
+        write(row, write_func);
+    } else {
+        Id assigned = row.id;
+        row.id = write_keyed(FUNC_TABLE, assigned, row, write_func, [this, &row]() {
+            return select_id(SELECT_FUNC_ID,
+                             "select id from func where signature_id = (select id from string where value = ?1)",
+                             row.signature);
+        });
+        if (row.id == 0) {
+            return 0;
+        }
+        func_ids_.cache(row.signature, row.id);
+        if (row.id != assigned) {
+            // Written before, like one found in func_ids_.
+            return row.id;
+        }
+    }
+    if (inserted) {
+        *inserted = true;
+    }
+
+    wrote_file(row.location.file_id);
+    insert_comment("func", row.id, row.comment);
+
+    return row.id;
+}
+
+Id Database::insert(FunctionParam &row) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    row.id = new_row_id(RowKey{FUNC_PARAM_TABLE, row.function_id, row.position, 0, ""});
+    if (row.id == 0) {
+        return 0;
+    }
+
+    write(row, [this](const FunctionParam &row) {
+        auto stmt = prepare(INSERT_FUNC_PARAM,
+                            "insert into func_param(id, func_id, position, type_id, name, default_value) "
+                            "values (?, ?, ?, ?, ?, ?)");
+        bind(stmt, 1, row.id);
+        bind_pk(stmt, 2, row.function_id);
+        bind(stmt, 3, row.position);
+        bind_pk(stmt, 4, row.type_id);
+        bind(stmt, 5, row.name);
+        bind(stmt, 6, row.default_value);
+        exec(stmt);
+    });
+
+    return row.id;
 }
 
-int Database::insert(MethodOverride &row) {
-    MemBuf mb;
+Id Database::insert(MethodOverride &row) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    row.id = new_row_id(RowKey{METHOD_OVERRIDE_TABLE, row.method_id, row.overridden_method_id, 0, ""});
+    if (row.id == 0) {
+        return 0;
+    }
 
-    mb.printf(R"SQL(
-              insert into method_override(method_id, overridden_method_id)
-              values (%d, %d))SQL",
-    row.method_id, row.overridden_method_id);
+    write(row, [this](const MethodOverride &row) {
+        auto stmt = prepare(INSERT_METHOD_OVERRIDE,
+                            "insert into method_override(id, method_id, overridden_method_id) values (?, ?, ?)");
+        bind(stmt, 1, row.id);
+        bind_pk(stmt, 2, row.method_id);
+        bind_pk(stmt, 3, row.overridden_method_id);
+        exec(stmt);
+    });
 
-    return (row.id = exec(mb));
+    return row.id;
 }
 
-int Database::insert(VarDecl &row) {
-    MemBuf mb;
-    mb << "insert or ignore into var_decl(class_id, type_id, name, file_id, start_line, end_line, start_column, end_column) "
-       << "values (" << sql::pk(row.class_id) << "," << sql::pk(row.type_id) << "," << sql::str(row.name) << ","
-       << get_file_id(row.location.file) << "," << row.location.start_line << "," << row.location.end_line << ","
-       << row.location.start_column << "," << row.location.end_column << ")";
-    row.id = exec(mb);
+Id Database::insert(VarDecl &row) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    RowKey key{VAR_DECL_TABLE, row.location.file_id, row.location.end_line, row.location.end_column, ""};
+    auto it = var_ids_.find(key);
+    if (it != var_ids_.end()) {
+        return (row.id = it->second);
+    }
+
+    row.id = new_id(key);
+    if (row.id == 0) {
+        return 0;
+    }
+    var_ids_.cache(key, row.id);
+
+    wrote_file(row.location.file_id);
+    write(row, [this](const VarDecl &row) {
+        auto stmt = prepare(INSERT_VAR_DECL,
+                            "insert into var_decl(id, class_id, type_id, name, file_id, start_line, end_line, "
+                            "start_column, end_column) values (?, ?, ?, ?, ?, ?, ?, ?, ?)");
+        bind(stmt, 1, row.id);
+        bind_pk(stmt, 2, row.class_id);
+        bind_pk(stmt, 3, row.type_id);
+        bind(stmt, 4, row.name);
+        bind_pk(stmt, 5, row.location.file_id);
+        bind_location(stmt, 6, row.location);
+        exec(stmt);
+    });
+
     return row.id;
 }
 
-int Database::insert(VarRef &row) {
-    MemBuf mb;
-    mb << "insert or ignore into var_ref(var_id, file_id, start_line, end_line, start_column, end_column) "
-       << "values (" << sql::pk(row.var_id) << "," << get_file_id(row.location.file)
-       << "," << row.location.start_line << "," << row.location.end_line << "," << row.location.start_column
-       << "," << row.location.end_column << ")";
-    row.id = exec(mb);
+Id Database::insert(VarRef &row) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto &location = row.location;
+    row.id = new_row_id(RowKey{VAR_REF_TABLE, location.file_id, location.end_line, location.end_column, ""});
+    if (row.id == 0) {
+        return 0;
+    }
+
+    wrote_file(row.location.file_id);
+    write(row, [this](const VarRef &row) {
+        auto stmt = prepare(INSERT_VAR_REF,
+                            "insert or ignore into var_ref(id, var_id, file_id, start_line, end_line, start_column, "
+                            "end_column) values (?, ?, ?, ?, ?, ?, ?)");
+        bind(stmt, 1, row.id);
+        bind_pk(stmt, 2, row.var_id);
+        bind_pk(stmt, 3, row.location.file_id);
+        bind_location(stmt, 4, row.location);
+        exec(stmt);
+    });
+
     return row.id;
 }
 
-int Database::insert(FCall& row) {
-    MemBuf mb;
-    mb << "insert or ignore into fcall(func_id, file_id, start_line, end_line, start_column, end_column) "
-       << "values (" << sql::pk(row.func_id) << "," << get_file_id(row.location.file)
-       << "," << row.location.start_line << "," << row.location.end_line << "," << row.location.start_column
-       << "," << row.location.end_column << ")";
-    row.id = exec(mb);
+Id Database::insert(FCall &row) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto &location = row.location;
+    row.id = new_row_id(RowKey{FCALL_TABLE, location.file_id, location.end_line, location.end_column, ""});
+    if (row.id == 0) {
+        return 0;
+    }
+
+    wrote_file(row.location.file_id);
+    write(row, [this](const FCall &row) {
+        auto stmt = prepare(INSERT_FCALL,
+                            "insert or ignore into fcall(id, func_id, file_id, start_line, end_line, start_column, "
+                            "end_column) values (?, ?, ?, ?, ?, ?, ?)");
+        bind(stmt, 1, row.id);
+        bind_pk(stmt, 2, row.func_id);
+        bind_pk(stmt, 3, row.location.file_id);
+        bind_location(stmt, 4, row.location);
+        exec(stmt);
+    });
+
     return row.id;
 }
 
@@ -2,18 +2,33 @@
 
 #include <sqlite3.h>
 
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
 #include "membuf.h"
+#include "queue.h"
 
 namespace db {
 
+// A row id: sequential, or a 63-bit hash of the row's unique key with
+// Options::hash_ids.
+using Id = int64_t;
+
 struct Location {
-    std::string file;
+    Id file_id = 0;  // from Database::get_file_id()
     int start_line = 0;
     int end_line = 0;
     int start_column = 0;
     int end_column = 0;
 };
 
+// Written to the comment table, when not empty.
 struct Comment {
     std::string raw;
     std::string brief;
@@ -21,7 +36,7 @@ struct Comment {
 
 // A NamedDecl (class/union/enum).
 struct Decl {
-    int id = 0;
+    Id id = 0;
     std::string type;
     std::string name;
     Location location;
@@ -39,8 +54,8 @@ struct Decl {
 };
 
 struct TemplateParam {
-    int id;
-    int template_id;
+    Id id;
+    Id template_id;
     std::string template_type;   // function or class
     std::string name;   // e.g. T
     std::string kind;   // type/non-type/template
@@ -51,17 +66,17 @@ struct TemplateParam {
 };
 
 struct DeclBase {
-    int id = 0;
-    int decl_id = 0;
-    int base_id = 0;
+    Id id = 0;
+    Id decl_id = 0;
+    Id base_id = 0;
     int position = 0;
     std::string access;
 };
 
 struct DeclField {
-    int id = 0;
-    int decl_id = 0;
-    int type_id = 0;
+    Id id = 0;
+    Id decl_id = 0;
+    Id type_id = 0;
     std::string name;
     std::string access;
     Location location;
@@ -69,8 +84,8 @@ struct DeclField {
 };
 
 struct EnumField {
-    int id = 0;
-    int enum_id = 0;
+    Id id = 0;
+    Id enum_id = 0;
     std::string name;
     int value;
     Location location;
@@ -78,7 +93,7 @@ struct EnumField {
 };
 
 struct Type {
-    int id = 0;
+    Id id = 0;
     std::string name;
     std::string decl_name;
     std::string decl_kind;
@@ -89,23 +104,23 @@ struct Type {
 
 // TemplateArgument for TemplateSpecializationType
 struct TypeArgument {
-    int id;
-    int type_id;
+    Id id;
+    Id type_id;
     std::string kind;   // TemplateArgument::ArgKind
     std::string value;  // type name, expr, etc
-    int referenced_type_id = 0;
+    Id referenced_type_id = 0;
     int index;
 };
 
 struct Function {
-    int id = 0;
+    Id id = 0;
     std::string name;
     std::string qual_name;
     std::string signature;
     Location location;
     Comment comment;
-    int decl_id = 0;
-    int type_id = 0;
+    Id decl_id = 0;
+    Id type_id = 0;
     std::string access;
     bool is_static = false;
     bool is_inline = false;
@@ -117,81 +132,503 @@ struct Function {
 };
 
 struct FunctionParam {
-    int id = 0;
-    int function_id = 0;
+    Id id = 0;
+    Id function_id = 0;
     int position = 0;
-    int type_id = 0;
+    Id type_id = 0;
     std::string name;
     std::string default_value;
 };
 
 struct MethodOverride {
-    int id = 0;
-    int method_id = 0;
-    int overridden_method_id = 0;
+    Id id = 0;
+    Id method_id = 0;
+    Id overridden_method_id = 0;
 };
 
 struct VarDecl {
-    int id;
-    int class_id = 0;
-    int type_id;
+    Id id;
+    Id class_id = 0;
+    Id type_id;
     std::string name;
     Location location;
 };
 
 struct VarRef {
-    int id;
-    int var_id;
+    Id id;
+    Id var_id;
     Location location;
 };
 
 struct FCall {
-    int id;
-    int func_id;
+    Id id;
+    Id func_id;
     Location location;
 };
 
+// A file as it was when it was last indexed.
+struct FileStamp {
+    Id file_id = 0;
+    int64_t size = 0;
+    int64_t mtime = 0;  // in nanoseconds
+    int64_t hash = 0;  // fnv1a() of the contents, 0 until indexed
+    bool include_guarded = false;
+    // fnv1a() of the macros the last translation unit to read it had
+    // defined: its predefines and, where it included the file, `macros`.
+    int64_t context = 0;
+    std::string macros;  // the macros the file tests or expands, separated by spaces
+};
+
+struct Options {
+    // Trade crash durability for load speed; safe settings are restored and
+    // the WAL is checkpointed when the database is closed.
+    bool fast_load = false;
+
+    // When clear() rebuilds the tables, load them without unique indexes and
+    // build the indexes in bulk in finish().
+    bool defer_indexes = false;
+
+    // Run SQLite on a writer thread so callers only assign IDs and queue rows.
+    bool async_writes = false;
+
+    // Derive every row id (except decl_tree's) from the row's unique key, so
+    // the same row gets the same id in every run and shard.
+    bool hash_ids = false;
+};
+
 class Database {
   private:
+    // Prepared statements, one per operation. Each is prepared on first use,
+    // reset after every step and finalized in ~Database.
+    enum Stmt {
+        INSERT_STRING,
+        INSERT_FILE,
+        INSERT_DECL,
+        INSERT_DECL_ROW,
+        UPDATE_DECL,
+        INSERT_TEMPLATE_PARAM,
+        INSERT_DECL_BASE,
+        INSERT_DECL_TREE_DIRTY,
+        INSERT_DECL_FIELD,
+        INSERT_ENUM_FIELD,
+        INSERT_TYPE,
+        INSERT_TYPE_ARGUMENT,
+        INSERT_FUNC,
+        UPDATE_FUNC,
+        INSERT_FUNC_PARAM,
+        INSERT_METHOD_OVERRIDE,
+        INSERT_VAR_DECL,
+        INSERT_VAR_REF,
+        INSERT_FCALL,
+        INSERT_COMMENT,
+        REPLACE_META,
+        SELECT_META,
+        UPDATE_FILE_STAMP,
+        RESET_FILE_STAMP,
+        DELETE_DEPENDENCIES,
+        INSERT_DEPENDENCY,
+        SELECT_DEPENDENCIES,
+        SELECT_STRING_ID,
+        SELECT_FILE_ID,
+        SELECT_DECL_ID,
+        SELECT_TYPE_ID,
+        SELECT_FUNC_ID,
+        DELETE_FILE,
+        DELETE_FUNC,
+        BEGIN,
+        COMMIT,
+        ROLLBACK,
+        STMT_COUNT
+    };
+
+    // Row IDs are assigned here rather than by SQLite, so they are known
+    // before a row is written. Each transaction takes the write lock as it
+    // begins and reloads the counters, so rows that another process wrote
+    // in between keep their ids.
+    enum Table {
+        FILE_TABLE,
+        DECL_TABLE,
+        TEMPLATE_PARAM_TABLE,
+        DECL_BASE_TABLE,
+        DECL_FIELD_TABLE,
+        ENUM_FIELD_TABLE,
+        TYPE_TABLE,
+        TYPE_ARGUMENT_TABLE,
+        FUNC_TABLE,
+        FUNC_PARAM_TABLE,
+        METHOD_OVERRIDE_TABLE,
+        VAR_DECL_TABLE,
+        VAR_REF_TABLE,
+        FCALL_TABLE,
+        COMMENT_TABLE,
+        STRING_TABLE,
+        TABLE_COUNT
+    };
+
+    struct TypeKey {
+        std::string name;
+        int template_parameter_index;
+
+        bool operator==(const TypeKey &other) const {
+            return template_parameter_index == other.template_parameter_index && name == other.name;
+        }
+    };
+
+    struct TypeKeyHash {
+        size_t operator()(const TypeKey &key) const {
+            return std::hash<std::string>()(key.name) * 31 + key.template_parameter_index;
+        }
+    };
+
+    // The unique key of a var_decl row, or of any row written while indexes
+    // are deferred.
+    struct RowKey {
+        Table table;
+        Id a;
+        Id b;
+        Id c;
+        std::string name;
+
+        bool operator==(const RowKey &other) const {
+            return table == other.table && a == other.a && b == other.b && c == other.c && name == other.name;
+        }
+    };
+
+    struct RowKeyHash {
+        size_t operator()(const RowKey &key) const {
+            size_t h = std::hash<std::string>()(key.name);
+            for (Id n : {(Id)key.table, key.a, key.b, key.c}) {
+                h = h * 31 + n;
+            }
+            return h;
+        }
+    };
+
+    // Held by every public method, so one Database can be shared by several
+    // indexing threads.
+    std::mutex mutex_;
+
     sqlite3 *db_;
+    sqlite3_stmt *stmts_[STMT_COUNT];
+    Options options_;
+    bool deferring_;
+    Id next_ids_[TABLE_COUNT];
+    Id begin_ids_[TABLE_COUNT];  // next_ids_ when the transaction began
+
+    std::thread writer_;
+    BoundedQueue<std::function<void()>> queue_;
+
+    // A cache that logs its changes since the transaction began, so a
+    // rollback can undo them, newest first, instead of reloading it. Only
+    // changed by the caller's thread and by call(), never by queued writes.
+    // An added entry is logged by its node, whose address is stable, so long
+    // keys are not copied; removed and replaced entries are copied.
+    template <class Container>
+    struct Journaled : Container {
+        using Key = typename Container::key_type;
+        using Entry = typename Container::value_type;
+
+        struct Change {
+            const Entry *node;
+            size_t old;  // index in olds, or npos for an added entry
+            bool removed;
+        };
+        static constexpr size_t npos = (size_t)-1;
+
+        std::vector<Change> changes;
+        std::vector<Entry> olds;
+
+        static const Key &key_of(const Key &key) {
+            return key;
+        }
+        template <class Value>
+        static const Key &key_of(const std::pair<const Key, Value> &entry) {
+            return entry.first;
+        }
+
+        static void assign(const Key &, const Key &) {}
+        template <class Value>
+        static void assign(std::pair<const Key, Value> &entry, const std::pair<const Key, Value> &old) {
+            entry.second = old.second;
+        }
+
+        // Maps.
+        template <class Value>
+        void cache(const Key &key, const Value &value) {
+            auto result = this->emplace(key, value);
+            if (result.second) {
+                changes.push_back(Change{&*result.first, npos, false});
+            } else {
+                changes.push_back(Change{&*result.first, olds.size(), false});
+                olds.push_back(*result.first);
+                result.first->second = value;
+            }
+        }
+
+        // Sets.
+        bool cache(const Key &key) {
+            auto result = this->insert(key);
+            if (result.second) {
+                changes.push_back(Change{&*result.first, npos, false});
+            }
+            return result.second;
+        }
+
+        bool uncache(const Key &key) {
+            auto it = this->find(key);
+            if (it == this->end()) {
+                return false;
+            }
+            changes.push_back(Change{&*it, olds.size(), true});
+            olds.push_back(*it);
+            this->erase(it);
+            return true;
+        }
+
+        void undo() {
+            // Keys of the removed entries by their former nodes, for the
+            // changes logged before the removal.
+            std::unordered_map<const Entry *, size_t> removed;
+            for (auto it = changes.rbegin(); it != changes.rend(); ++it) {
+                if (it->old == npos) {
+                    auto node = removed.find(it->node);
+                    auto entry = this->find(node != removed.end() ? key_of(olds[node->second]) : key_of(*it->node));
+                    if (node != removed.end()) {
+                        removed.erase(node);
+                    }
+                    this->erase(entry);
+                } else if (it->removed) {
+                    removed[it->node] = it->old;
+                    this->insert(olds[it->old]);
+                } else {
+                    assign(*this->find(key_of(olds[it->old])), olds[it->old]);
+                }
+            }
+            keep();
+        }
+
+        void keep() {
+            changes.clear();
+            olds.clear();
+        }
+    };
+
+    // Row IDs by unique key, filled on insert and loaded when an existing
+    // database is opened, so lookups on the write path don't hit SQLite.
+    Journaled<std::unordered_map<std::string, Id>> string_ids_;
+    Journaled<std::unordered_map<std::string, Id>> file_ids_;
+    Journaled<std::unordered_map<std::string, Id>> decl_ids_;
+    Journaled<std::unordered_map<std::string, Id>> func_ids_;
+    Journaled<std::unordered_map<TypeKey, Id, TypeKeyHash>> type_ids_;
+    Journaled<std::unordered_map<RowKey, Id, RowKeyHash>> var_ids_;
+
+    // Without unique indexes, duplicates are rejected here instead.
+    Journaled<std::unordered_set<RowKey, RowKeyHash>> row_keys_;
+
+    // With hash ids: the ids in use and a second hash of the key each one
+    // was derived from, which tells a repeated row from a collision.
+    Journaled<std::unordered_map<Id, size_t>> hashed_ids_[TABLE_COUNT];
+    int collisions_;
+
+    // Decls whose bases changed since decl_tree was last updated.
+    std::unordered_set<Id> dirty_decls_;
+
+    // Decls known only by name, and functions whose file was removed; both
+    // keep their ids and rows until they are written again. finish() deletes
+    // the functions that were not.
+    Journaled<std::unordered_set<Id>> placeholder_decls_;
+    Journaled<std::unordered_set<Id>> removed_funcs_;
+
+    // By file id.
+    Journaled<std::unordered_map<Id, FileStamp>> file_stamps_;
+
+    // Owned by the writer thread when there is one.
+    bool in_transaction_;
+    int commit_interval_;
+    int pending_writes_;
+    bool batch_committed_;  // by exec() since begin()
+    bool outdated_;         // written by an older version, until clear()
+
+    // With a commit interval, the files rows were written to since begin(),
+    // for rollback().
+    std::unordered_set<Id> written_files_;
 
     int create_tables();
     int table_count();
-
-    int get_int(const MemBuf &);
-    int exec(const MemBuf &);
-
-    int get_file_id(const std::string &path);
-
-    int update_location(const char *table, int id, Location &);
-    int update_comment(const char *table, int id, Comment &);
+    bool has_current_schema();
+    int exec_script(const char *sql);
+    int finish_load();
+    int create_indexes();
+    int update_decl_tree();
+    int delete_removed_funcs();
+    void load_caches();
+    void load_next_ids();
+    void load_row_keys();
+    void load_id(const RowKey &key, Id id);
+    void clear_caches();
+
+    // Rolls the journaled caches back to, or keeps them as, their state
+    // when the transaction began.
+    void undo_caches();
+    void keep_caches();
+
+    // remove_file_rows() on the writer thread.
+    int remove_rows(Id file_id);
+
+    void wrote_file(Id file_id) {
+        if (commit_interval_ > 0 && file_id > 0) {
+            written_files_.insert(file_id);
+        }
+    }
+
+    // Drops the cached keys of the rows that cascade away with a file.
+    void forget_file_rows(Id file_id);
+
+    bool is_duplicate(RowKey &&key);
+    void insert_comment(const char *owner_type, Id owner_id, const Comment &comment);
+    // Returns the id of `value` in the string table, writing the string the
+    // first time it is seen; 0 for an empty one unless !use_null_for_empty.
+    Id intern(const std::string &value, bool use_null_for_empty = true);
+
+    Id next_id(Table table) {
+        return ++next_ids_[table];
+    }
+
+    // Returns the id of a row whose key isn't cached yet, or 0 when its hash
+    // id is already taken.
+    Id new_id(const RowKey &key);
+
+    // Returns the id of a row without a key cache, or 0 for a row that was
+    // already written.
+    Id new_row_id(RowKey &&key);
+
+    sqlite3_stmt *prepare(Stmt, const char *sql);
+    int exec(sqlite3_stmt *);
+
+    // Steps an insert that does nothing when its unique key is taken;
+    // returns 1 in that case, 0 once the row is written and -1 on error.
+    int exec_keyed(sqlite3_stmt *);
+
+    // Returns the id of the row a SELECT_*_ID statement finds by `name` (?1)
+    // and `index` (?2), or 0.
+    Id select_id(Stmt, const char *sql, const std::string &name, int index = 0);
+    int transaction(Stmt, const char *sql);
+    int begin_transaction();
+    int commit_transaction();
+    int commit_batch();
+    int rollback_transaction();
+
+    // Runs `fn` on the writer thread after everything queued before it and
+    // waits for its result; without a writer thread it runs right away.
+    int call(std::function<int()> fn);
+
+    // Writes a row on the writer thread, from a copy of `row`, or right away
+    // without a writer thread.
+    template <class Row, class Fn>
+    void write(const Row &row, Fn fn) {
+        if (writer_.joinable()) {
+            queue_.push([row, fn]() { fn(row); });
+        } else {
+            fn(row);
+        }
+    }
+
+    // Writes a row under a key the caches don't hold, like write(), with
+    // `fn` returning exec_keyed(). Without a writer thread the row is written
+    // right away: if the key already has a row, one the caches missed, its
+    // id is looked up by `select` and returned instead of `id`; 0 when the
+    // row could not be written.
+    template <class Row, class Fn, class Select>
+    Id write_keyed(Table table, Id id, const Row &row, Fn fn, Select select);
 
   public:
-    Database(const char *dbname);
-    Database(std::string &dbname) : Database(dbname.c_str()) {}
+    Database(const char *dbname, const Options &options = Options());
+    Database(std::string &dbname, const Options &options = Options()) : Database(dbname.c_str(), options) {}
     ~Database();
 
+    // False when the database could not be opened.
+    bool is_open() const {
+        return db_ != nullptr;
+    }
+
+    // True for a database written by a version before the string table and
+    // file stamps. Nothing can be written to it until clear().
+    bool is_outdated() const {
+        return outdated_;
+    }
+
     int clear();
 
-    int get_decl_id(const std::string &name, bool *inserted = nullptr);
-    int get_type_id(const std::string &name);
-    int get_func_id(const std::string &signature);
-    int get_var_id(const std::string &file, int end_line, int end_column);
-
-    int insert(Decl &decl, bool *inserted = nullptr);
-    int insert(TemplateParam &param);
-
-    int insert(DeclBase &base);
-    int insert(DeclField &field);
-    int insert(EnumField &field);
-    int insert(Type &type, bool *inserted);
-    int insert(TypeArgument &arg);
-    int insert(Function &func);
-    int insert(FunctionParam &param);
-    int insert(MethodOverride &mo);
-    int insert(VarDecl &decl);
-    int insert(VarRef& ref);
-    int insert(FCall& ref);
+    // Completes a run: builds deferred indexes, deletes the functions that
+    // disappeared from re-indexed files, brings decl_tree up to date for the
+    // decls whose bases changed and restores safe PRAGMAs.
+    int finish();
+
+    // Starts a transaction; writes are committed by commit() or, when a
+    // commit interval is set, after every `interval` rows. rollback() then
+    // cannot undo the batches already committed: it removes the rows of
+    // every file written since begin() instead, like remove_file_rows(), and
+    // clears their stamps so whatever read them is indexed again.
+    int begin();
+    int commit();
+    int rollback();
+    void set_commit_interval(int interval) {
+        commit_interval_ = interval;
+    }
+
+    int set_meta(const std::string &key, const std::string &value);
+
+    // Returns false when the database has no value for `key`.
+    bool get_meta(const std::string &key, std::string &value);
+
+    // Returns false for a file that was never indexed.
+    bool get_file_stamp(const std::string &path, FileStamp &stamp);
+
+    // Stamps the files read by a translation unit and records them as its
+    // dependencies, by the file id of its main file.
+    int set_dependencies(Id tu_id, const std::vector<FileStamp> &files);
+
+    // The dependencies of the translation unit whose main file is `path`,
+    // with their paths and stamps (a zero hash for a file whose rows were
+    // removed since); empty if it was never indexed.
+    std::vector<std::pair<std::string, FileStamp>> get_dependencies(const std::string &path);
+
+    // Deletes the rows located in a file, and the rows that belong to them,
+    // so it can be indexed again. Its decls become placeholders and its
+    // functions keep their ids, so references from other files stay valid.
+    int remove_file_rows(Id file_id);
+
+    // Deletes a file and every row that originates from it, through the
+    // foreign key cascades, in one transaction (the current one, if any).
+    // Returns 0 when the file is not in the database.
+    int remove_file(const std::string &path);
+
+    // Copies every row of a database written with hash ids into this one,
+    // after checking that none of its ids stands for a different row here.
+    // Must be called outside a transaction; the key caches are not updated.
+    int copy_rows(const std::string &path);
+
+    // Returns 0 for an empty path.
+    Id get_file_id(const std::string &path);
+    Id get_decl_id(const std::string &name, bool *inserted = nullptr);
+    Id get_type_id(const std::string &name);
+    Id get_func_id(const std::string &signature);
+    Id get_var_id(Id file_id, int end_line, int end_column);
+
+    Id insert(Decl &decl, bool *inserted = nullptr);
+    Id insert(TemplateParam &param);
+
+    Id insert(DeclBase &base);
+    Id insert(DeclField &field);
+    Id insert(EnumField &field);
+    Id insert(Type &type, bool *inserted);
+    Id insert(TypeArgument &arg);
+    Id insert(Function &func, bool *inserted = nullptr);
+    Id insert(FunctionParam &param);
+    Id insert(MethodOverride &mo);
+    Id insert(VarDecl &decl);
+    Id insert(VarRef& ref);
+    Id insert(FCall& ref);
 };
 
 }  // namespace db
@@ -5,14 +5,36 @@
 #include <clang/AST/RecursiveASTVisitor.h>
 #include <clang/Frontend/CompilerInstance.h>
 #include <clang/Frontend/FrontendAction.h>
+#include <clang/Lex/HeaderSearch.h>
+#include <clang/Lex/Lexer.h>
+#include <clang/Lex/PPCallbacks.h>
+#include <clang/Lex/Preprocessor.h>
+#include <clang/Tooling/ArgumentsAdjusters.h>
+#include <clang/Tooling/CompilationDatabase.h>
 #include <clang/Tooling/Tooling.h>
-
+#include <llvm/Support/Chrono.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/VirtualFileSystem.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <cctype>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include "membuf.h"
+#include "util.h"
 
 using namespace clang;
 
@@ -20,14 +42,126 @@ static const char *to_string(const AccessSpecifier access);
 static std::string get_template_arg_kind_name(const clang::TemplateArgument::ArgKind &kind);
 static std::string get_ns(const Decl *val);
 
+// The content hash kept in the file table and in the guarded header registry.
+static int64_t hash_contents(llvm::StringRef data) {
+    return (int64_t)fnv1a(data.data(), data.size());
+}
+
+// Modification times are stamped in nanoseconds, so a file edited within the
+// second it was indexed in still looks changed.
+static int64_t to_nanoseconds(llvm::sys::TimePoint<> time) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+}
+
+// The macros each file tests in its conditionals or expands, recorded while
+// the translation unit is preprocessed: what a header declares depends on
+// how they were defined where it was included.
+struct MacroUses {
+    using Names = std::unordered_set<const IdentifierInfo *>;
+    std::map<FileID, Names> tested;
+    std::map<FileID, Names> expanded;
+
+    // The macro of a file's first conditional if that is an #ifndef: its
+    // include guard, when it has one.
+    std::map<FileID, const IdentifierInfo *> guards;
+};
+
+class MacroUseRecorder : public PPCallbacks {
+  public:
+    MacroUseRecorder(Preprocessor &preprocessor, std::shared_ptr<MacroUses> uses)
+        : preprocessor_(preprocessor), source_manager_(preprocessor.getSourceManager()), uses_(uses) {}
+
+    void MacroExpands(const Token &name, const MacroDefinition &, SourceRange, const MacroArgs *) override {
+        FileID fid = file_of(name.getLocation());
+        if (fid != last_fid_ || !last_expanded_) {
+            last_fid_ = fid;
+            last_expanded_ = &uses_->expanded[fid];
+        }
+        last_expanded_->insert(name.getIdentifierInfo());
+    }
+
+    void Ifdef(SourceLocation loc, const Token &name, const MacroDefinition &) override {
+        test(loc, name.getIdentifierInfo(), false);
+    }
+
+    void Ifndef(SourceLocation loc, const Token &name, const MacroDefinition &) override {
+        test(loc, name.getIdentifierInfo(), true);
+    }
+
+    void If(SourceLocation loc, SourceRange condition, ConditionValueKind) override {
+        test_condition(loc, condition);
+    }
+
+    void Elif(SourceLocation loc, SourceRange condition, ConditionValueKind, SourceLocation) override {
+        test_condition(loc, condition);
+    }
+
+  private:
+    FileID file_of(SourceLocation loc) {
+        return source_manager_.getFileID(source_manager_.getExpansionLoc(loc));
+    }
+
+    void test(SourceLocation loc, const IdentifierInfo *name, bool ifndef) {
+        FileID fid = file_of(loc);
+        uses_->guards.emplace(fid, ifndef ? name : nullptr);
+        uses_->tested[fid].insert(name);
+    }
+
+    // Every identifier of the condition counts: MacroExpands() misses the
+    // macros that are not defined here.
+    void test_condition(SourceLocation loc, SourceRange condition) {
+        FileID fid = file_of(loc);
+        uses_->guards.emplace(fid, nullptr);
+        auto &tested = uses_->tested[fid];
+        llvm::StringRef text = Lexer::getSourceText(CharSourceRange::getTokenRange(condition), source_manager_,
+                                                    preprocessor_.getLangOpts());
+        auto is_word = [&text](size_t i) { return isalnum((unsigned char)text[i]) || text[i] == '_'; };
+        for (size_t i = 0; i < text.size();) {
+            if (!is_word(i)) {
+                i++;
+                continue;
+            }
+            size_t start = i;
+            while (i < text.size() && is_word(i)) {
+                i++;
+            }
+            // Skips numbers and their suffixes.
+            llvm::StringRef word = text.slice(start, i);
+            if (!isdigit((unsigned char)word[0]) && word != "defined") {
+                tested.insert(preprocessor_.getIdentifierInfo(word));
+            }
+        }
+    }
+
+    Preprocessor &preprocessor_;
+    SourceManager &source_manager_;
+    std::shared_ptr<MacroUses> uses_;
+    FileID last_fid_;
+    MacroUses::Names *last_expanded_ = nullptr;
+};
+
 class IndexerVisitor : public RecursiveASTVisitor<IndexerVisitor> {
   public:
-    explicit IndexerVisitor(ASTContext &context, SourceManager *source_manager, Indexer &builder)
-        : context_(context), source_manager_(source_manager), indexer_(builder) {}
+    explicit IndexerVisitor(ASTContext &context, SourceManager *source_manager, Preprocessor &preprocessor,
+                            Indexer &builder, Indexer::IndexedFiles &files, int64_t macro_context,
+                            std::shared_ptr<MacroUses> macro_uses)
+        : context_(context),
+          source_manager_(source_manager),
+          preprocessor_(preprocessor),
+          header_search_(preprocessor.getHeaderSearchInfo()),
+          indexer_(builder),
+          files_(files),
+          macro_context_(macro_context),
+          macro_uses_(macro_uses),
+          signature_policy_(context.getLangOpts()),
+          type_lookups_(0),
+          type_hits_(0) {
+        signature_policy_.SuppressTagKeyword = true;
+    }
 
     bool accept(const clang::Decl *d) {
-        const clang::FileEntry *fe = getFileEntryForDecl(d, source_manager_);
-        if (!fe) {
+        const FileInfo &info = file_info(d);
+        if (!info.has_file) {
             if (auto decl = llvm::dyn_cast<clang::NamedDecl>(d)) {
                 std::string name = decl->getQualifiedNameAsString();
                 if (name.substr(0, 5) == "std::" || name.substr(0, 2) == "__") {
@@ -36,13 +170,275 @@ class IndexerVisitor : public RecursiveASTVisitor<IndexerVisitor> {
             }
             return true;
         }
-        return indexer_.accept(fe->getName().str().c_str());
+        return info.accepted;
+    }
+
+    // Files are resolved, checked against Indexer::accept() and given a
+    // file_id once per translation unit.
+    struct FileInfo {
+        bool has_file;
+        bool accepted;
+        db::Id file_id;  // -1 until a row needs it
+    };
+
+    FileInfo &file_info(FileID fid) {
+        auto it = file_infos_.find(fid.getHashValue());
+        if (it != file_infos_.end()) {
+            return it->second;
+        }
+
+        const FileEntry *fe = source_manager_->getFileEntryForID(fid);
+        FileInfo info;
+        info.has_file = fe != nullptr;
+        info.accepted = !fe || indexer_.accept(fe->getName().str().c_str());
+        info.file_id = fe ? -1 : 0;
+        FileInfo &result = file_infos_[fid.getHashValue()] = info;
+        if (fe && info.accepted) {
+            refresh(fid, result);
+        }
+        return result;
+    }
+
+    // A file indexed by an earlier run loses its rows before any are written
+    // again: the main file always, a header when its contents changed. Each
+    // file is refreshed once per run, however many translation units read it.
+    void refresh(FileID fid, FileInfo &info) {
+        auto &db = indexer_.db();
+        db::FileStamp stamp;
+        if (!db.get_file_stamp(source_manager_->getFileEntryForID(fid)->getName().str(), stamp)) {
+            return;
+        }
+        info.file_id = stamp.file_id;
+        if (fid == source_manager_->getMainFileID() || content_hash(fid) != stamp.hash) {
+            indexer_.refresh(stamp.file_id);
+        }
+    }
+
+    // The macros a file is indexed with: the predefines, and the definitions
+    // of `macros` where the file was included.
+    int64_t context_of(FileID fid, const std::string &macros) {
+        SourceLocation include = source_manager_->getIncludeLoc(fid);
+        if (include.isInvalid()) {
+            return macro_context_;
+        }
+        uint64_t context = (uint64_t)macro_context_;
+        std::istringstream names(macros);
+        std::string name;
+        while (names >> name) {
+            context = fnv1a(name.c_str(), name.size() + 1, context);
+            auto definition = preprocessor_.getMacroDefinitionAtLoc(preprocessor_.getIdentifierInfo(name), include);
+            if (const MacroInfo *info = definition.getMacroInfo()) {
+                llvm::StringRef text;
+                if (!info->isBuiltinMacro()) {
+                    text = Lexer::getSourceText(
+                        CharSourceRange::getTokenRange(info->getDefinitionLoc(), info->getDefinitionEndLoc()),
+                        *source_manager_, context_.getLangOpts());
+                }
+                context = fnv1a(text.data(), text.size(), fnv1a("#define", context));
+            }
+        }
+        return (int64_t)context;
+    }
+
+    static int64_t in_context(int64_t hash, int64_t context) {
+        return (int64_t)fnv1a(&hash, sizeof(hash), (uint64_t)context);
+    }
+
+    // Lists the macros each file tests or expands, including those tested by
+    // the files it includes, except for their include guards.
+    void collect_macros() {
+        std::map<FileID, std::set<std::string>> names;
+        for (const auto &file : macro_uses_->expanded) {
+            for (auto name : file.second) {
+                names[file.first].insert(name->getName().str());
+            }
+        }
+        for (const auto &file : macro_uses_->tested) {
+            const IdentifierInfo *guard = nullptr;
+            auto it = macro_uses_->guards.find(file.first);
+            const FileEntry *fe = source_manager_->getFileEntryForID(file.first);
+            if (it != macro_uses_->guards.end() && fe && header_search_.isFileMultipleIncludeGuarded(fe)) {
+                guard = it->second;
+            }
+            for (auto name : file.second) {
+                names[file.first].insert(name->getName().str());
+                if (name == guard) {
+                    continue;
+                }
+                SourceLocation include = source_manager_->getIncludeLoc(file.first);
+                while (include.isValid()) {
+                    FileID parent = source_manager_->getFileID(include);
+                    names[parent].insert(name->getName().str());
+                    include = source_manager_->getIncludeLoc(parent);
+                }
+            }
+        }
+        for (const auto &file : names) {
+            std::string &macros = macros_[file.first];
+            for (const auto &name : file.second) {
+                if (!macros.empty()) {
+                    macros += ' ';
+                }
+                macros += name;
+            }
+        }
+    }
+
+    std::string macros_of(FileID fid) const {
+        auto it = macros_.find(fid);
+        return it != macros_.end() ? it->second : std::string();
+    }
+
+    // By FileEntry, so a header entered several times is hashed once.
+    int64_t content_hash(FileID fid) {
+        const FileEntry *fe = source_manager_->getFileEntryForID(fid);
+        auto it = content_hashes_.find(fe);
+        if (it != content_hashes_.end()) {
+            return it->second;
+        }
+        int64_t hash = 0;
+        if (auto buffer = source_manager_->getBufferOrNone(fid)) {
+            hash = hash_contents(buffer->getBuffer());
+        }
+        return content_hashes_[fe] = hash;
+    }
+
+    FileInfo &file_info(const Decl *d) {
+        return file_info(source_manager_->getFileID(d->getLocation()));
+    }
+
+    // Returns 0 for locations without a file.
+    db::Id file_id_of(FileID fid) {
+        FileInfo &info = file_info(fid);
+        if (info.file_id < 0) {
+            info.file_id = indexer_.db().get_file_id(source_manager_->getFileEntryForID(fid)->getName().str());
+        }
+        return info.file_id;
+    }
+
+    // Every decl, including those in DeclStmts, is traversed through here,
+    // so nothing below a decl in a rejected file is visited: neither nested
+    // decls nor the expressions in function bodies. Decls from
+    // include-guarded headers that an earlier translation unit indexed with
+    // the same contents are skipped too.
+    bool TraverseDecl(Decl *d) {
+        if (d && !isa<TranslationUnitDecl>(d)) {
+            FileID fid = source_manager_->getFileID(d->getLocation());
+            if (!accept(fid) || (config.skip_indexed_headers && is_indexed(fid))) {
+                return true;
+            }
+        }
+        return RecursiveASTVisitor<IndexerVisitor>::TraverseDecl(d);
+    }
+
+    // Statements (function bodies, initializers) only hold calls, references
+    // and local variables.
+    bool TraverseStmt(Stmt *s, DataRecursionQueue *queue = nullptr) {
+        if (!extracts(Config::EXTRACT_CALLS | Config::EXTRACT_REFS | Config::EXTRACT_LOCALS)) {
+            return true;
+        }
+        return RecursiveASTVisitor<IndexerVisitor>::TraverseStmt(s, queue);
+    }
+
+    static bool extracts(unsigned what) {
+        return (config.extract & what) != 0;
+    }
+
+    // Decls without a file are left to accept(const Decl *).
+    bool accept(FileID fid) {
+        return file_info(fid).accepted;
+    }
+
+    // Only include-guarded headers are ever registered, so a match in the
+    // registry also means the file is guarded; that is not known yet for a
+    // header still being parsed. A guarded header stamped by an earlier run
+    // with the same contents counts as indexed too. Either way the header
+    // must have been indexed with the same macros, since they select what a
+    // header declares: the same predefines, and the same definitions, where
+    // it was included, of the macros it tests or expands.
+    bool is_indexed(FileID fid) {
+        auto it = indexed_files_.find(fid.getHashValue());
+        if (it != indexed_files_.end()) {
+            return it->second;
+        }
+
+        bool indexed = false;
+        const FileEntry *fe = source_manager_->getFileEntryForID(fid);
+        if (fe && fid != source_manager_->getMainFileID()) {
+            if (source_manager_->getBufferOrNone(fid)) {
+                std::string path = fe->tryGetRealPathName().str();
+                if (path.empty()) {
+                    path = fe->getName().str();
+                }
+                int64_t hash = content_hash(fid);
+                Indexer::IndexedFile file;
+                db::FileStamp stamp;
+                indexed = (indexer_.find_indexed(path, file) &&
+                           file.hash == in_context(hash, context_of(fid, file.macros))) ||
+                          (indexer_.db().get_file_stamp(fe->getName().str(), stamp) && stamp.include_guarded &&
+                           stamp.hash == hash && stamp.context == context_of(fid, stamp.macros));
+                if (!indexed) {
+                    traversed_files_.push_back(TraversedFile{fid, fe, path, hash});
+                }
+            }
+        }
+
+        indexed_files_[fid.getHashValue()] = indexed;
+        return indexed;
+    }
+
+    // Called once the whole translation unit is parsed.
+    void finish() {
+        collect_macros();
+        for (const auto &file : traversed_files_) {
+            if (header_search_.isFileMultipleIncludeGuarded(file.entry)) {
+                std::string macros = macros_of(file.fid);
+                files_[file.path] = Indexer::IndexedFile{in_context(file.hash, context_of(file.fid, macros)), macros};
+            }
+        }
+        record_dependencies();
+        if (config.verbose) {
+            print_stats();
+        }
+    }
+
+    // Stamps every accepted file the translation unit read, so the next run
+    // can tell whether it changed. A translation unit with errors is left
+    // without dependencies, so the next run indexes it again: with -j, its
+    // transaction is not rolled back on its own.
+    void record_dependencies() {
+        FileID main_fid = source_manager_->getMainFileID();
+        if (!accept(main_fid)) {
+            return;
+        }
+        std::vector<db::FileStamp> files;
+        if (context_.getDiagnostics().hasErrorOccurred()) {
+            indexer_.db().set_dependencies(file_id_of(main_fid), files);
+            return;
+        }
+        for (auto it = source_manager_->fileinfo_begin(); it != source_manager_->fileinfo_end(); ++it) {
+            const FileEntry *fe = it->first;
+            FileID fid = source_manager_->translateFile(fe);
+            if (fid.isInvalid() || !it->second->getBufferDataIfLoaded() || !accept(fid)) {
+                continue;
+            }
+            db::FileStamp stamp;
+            stamp.file_id = file_id_of(fid);
+            stamp.size = fe->getSize();
+            auto status = source_manager_->getFileManager().getVirtualFileSystem().status(fe->getName());
+            stamp.mtime = status ? to_nanoseconds(status->getLastModificationTime()) : 0;
+            stamp.hash = content_hash(fid);
+            stamp.include_guarded = header_search_.isFileMultipleIncludeGuarded(fe);
+            stamp.macros = macros_of(fid);
+            stamp.context = context_of(fid, stamp.macros);
+            files.push_back(stamp);
+        }
+        indexer_.db().set_dependencies(file_id_of(main_fid), files);
     }
 
     db::Location location_of(const Decl *d) {
-        const clang::FileEntry *fe = getFileEntryForDecl(d, source_manager_);
         db::Location location;
-        location.file = fe ? fe->getName().str().c_str() : "";
+        location.file_id = file_id_of(source_manager_->getFileID(d->getLocation()));
         set_range(location, d->getSourceRange());
         return location;
     }
@@ -58,10 +454,13 @@ class IndexerVisitor : public RecursiveASTVisitor<IndexerVisitor> {
     }
 
     bool VisitTagDecl(const TagDecl *d) {
-        const clang::FileEntry *fe = getFileEntryForDecl(d, source_manager_);
+        if (!extracts(Config::EXTRACT_DECLS)) {
+            return true;
+        }
+
         auto &db = indexer_.db();
 
-        if (d->isThisDeclarationADefinition() && fe && accept(d)) {
+        if (d->isThisDeclarationADefinition() && file_info(d).has_file && accept(d)) {
             db::Decl row;
             row.type = d->getKindName();
             row.name = signature_of(d->getTypeForDecl()->getCanonicalTypeUnqualified());
@@ -191,7 +590,7 @@ class IndexerVisitor : public RecursiveASTVisitor<IndexerVisitor> {
 
     bool VisitTypedefDecl(TypedefDecl *d) {
         db::Decl row;
-        if (accept(d)) {
+        if (extracts(Config::EXTRACT_DECLS) && accept(d)) {
             row.type = "typedef";
             row.name = d->getQualifiedNameAsString();
             row.underlying_type = signature_of(d->getUnderlyingType());
@@ -202,7 +601,7 @@ class IndexerVisitor : public RecursiveASTVisitor<IndexerVisitor> {
 
     bool VisitTypeAliasDecl(TypeAliasDecl *d) {
         db::Decl row;
-        if (accept(d)) {
+        if (extracts(Config::EXTRACT_DECLS) && accept(d)) {
             row.type = "using";
             row.name = d->getQualifiedNameAsString();
             row.underlying_type = d->getUnderlyingType().getAsString();
@@ -213,19 +612,19 @@ class IndexerVisitor : public RecursiveASTVisitor<IndexerVisitor> {
     }
 
     bool VisitFunctionDecl(FunctionDecl *decl) {
-        if (!accept(decl)) {
+        if (!extracts(Config::EXTRACT_FUNCS) || !accept(decl)) {
             return true;
         }
 
         auto row = to_row(decl);
         auto &db = indexer_.db();
 
-        if (db.get_func_id(row.signature) > 0) {
+        bool inserted = false;
+        func_ids_[decl->getCanonicalDecl()] = db.insert(row, &inserted);
+        if (!inserted) {
             return true;
         }
 
-        db.insert(row);
-
         if (decl->isTemplated() && decl->getDescribedFunctionTemplate()) {
             TemplateParameterList *params = decl->getDescribedFunctionTemplate()->getTemplateParameters();
             if (params) {
@@ -261,7 +660,7 @@ class IndexerVisitor : public RecursiveASTVisitor<IndexerVisitor> {
             for (const auto &m : method->overridden_methods()) {
                 if (m->getParent() != method->getParent()) {
                     db::MethodOverride entry{.method_id = row.id,
-                                             .overridden_method_id = indexer_.db().get_func_id(signature_of(m))};
+                                             .overridden_method_id = func_id_of(m)};
                     db.insert(entry);
                 }
             }
@@ -270,7 +669,20 @@ class IndexerVisitor : public RecursiveASTVisitor<IndexerVisitor> {
         return true;
     }
 
-    int insert_type(const QualType &type, int decl_id = 0) {
+    db::Id insert_type(const QualType &type, db::Id decl_id = 0) {
+        if (!extracts(Config::EXTRACT_TYPES)) {
+            return 0;
+        }
+
+        // The same QualType (including its sugar and qualifiers) always
+        // produces the same row, so it is only built once per TU.
+        type_lookups_++;
+        auto it = type_ids_.find(type.getAsOpaquePtr());
+        if (it != type_ids_.end()) {
+            type_hits_++;
+            return it->second;
+        }
+
         auto &db = indexer_.db();
         db::Type row;
         std::vector<db::TypeArgument> type_arguments;
@@ -344,9 +756,18 @@ class IndexerVisitor : public RecursiveASTVisitor<IndexerVisitor> {
             }
         }
 
+        if (type_id > 0) {
+            type_ids_[type.getAsOpaquePtr()] = type_id;
+        }
+
         return type_id;
     }
 
+    void print_stats() {
+        printf("Type cache: %zu lookups, %zu hits (%.1f%%)\n", type_lookups_, type_hits_,
+               type_lookups_ ? 100.0 * type_hits_ / type_lookups_ : 0.0);
+    }
+
     std::string as_string(QualType type) {
         // if (auto builtin = type.getTypePtr()->getAs<BuiltinType>()) {
         //     if (builtin->getKind() == BuiltinType::Bool) {
@@ -375,13 +796,21 @@ class IndexerVisitor : public RecursiveASTVisitor<IndexerVisitor> {
         return signature_of(type);
     }
 
-    std::string signature_of(const QualType &type) {
-        PrintingPolicy pp(context_.getLangOpts());
-        pp.SuppressTagKeyword = true;
-        return type.getCanonicalType().getAsString(pp);
+    const std::string &signature_of(const QualType &type) {
+        QualType canonical = type.getCanonicalType();
+        auto it = type_signatures_.find(canonical.getAsOpaquePtr());
+        if (it != type_signatures_.end()) {
+            return it->second;
+        }
+        return type_signatures_[canonical.getAsOpaquePtr()] = canonical.getAsString(signature_policy_);
     }
 
-    std::string signature_of(const FunctionDecl *d) {
+    const std::string &signature_of(const FunctionDecl *d) {
+        auto it = func_signatures_.find(d);
+        if (it != func_signatures_.end()) {
+            return it->second;
+        }
+
         MemBuf mb;
         mb << d->getReturnType().getCanonicalType().getAsString() << ' ' << d->getQualifiedNameAsString() << '(';
         for (const auto &param : d->parameters()) {
@@ -396,7 +825,7 @@ class IndexerVisitor : public RecursiveASTVisitor<IndexerVisitor> {
                 mb << " const";
             }
         }
-        return mb.content();
+        return func_signatures_[d] = mb.content();
     }
 
     std::string signature_of(const clang::TemplateArgument &arg) {
@@ -448,7 +877,7 @@ class IndexerVisitor : public RecursiveASTVisitor<IndexerVisitor> {
     }
 
     bool VisitEnumConstantDecl(const EnumConstantDecl *decl) {
-        if (accept(decl)) {
+        if (extracts(Config::EXTRACT_DECLS) && accept(decl)) {
             auto &db = indexer_.db();
             const clang::EnumDecl *enum_decl = dyn_cast<clang::EnumDecl>(decl->getDeclContext());
             db::EnumField field;
@@ -464,24 +893,31 @@ class IndexerVisitor : public RecursiveASTVisitor<IndexerVisitor> {
     }
 
     bool VisitVarDecl(const VarDecl *decl) {
+        if (!extracts(decl->isLocalVarDeclOrParm() ? Config::EXTRACT_LOCALS : Config::EXTRACT_VARS)) {
+            return true;
+        }
+
         db::VarDecl row;
         row.location = location_of(decl);
         row.type_id = insert_type(decl->getType());
         row.name = decl->getNameAsString();
-        indexer_.db().insert(row);
+        var_ids_[decl] = indexer_.db().insert(row);
         return true;
     }
 
     bool VisitDeclRefExpr(DeclRefExpr *ref) {
+        if (!extracts(Config::EXTRACT_REFS)) {
+            return true;
+        }
+
         auto decl = ref->getDecl();
         if (auto *var_decl = dyn_cast<VarDecl>(decl)) {
-            auto fe = source_manager_->getFileEntryForID(source_manager_->getFileID(ref->getLocation()));
-            if (fe) {
+            db::Id file_id = file_id_of(source_manager_->getFileID(ref->getLocation()));
+            if (file_id > 0) {
                 auto& db = indexer_.db();
                 db::VarRef row;
-                db::Location var_loc = location_of(var_decl);
-                row.var_id = db.get_var_id(var_loc.file, var_loc.end_line, var_loc.end_column);
-                row.location.file = fe->getName();
+                row.var_id = var_id_of(var_decl);
+                row.location.file_id = file_id;
                 set_range(row.location, ref->getSourceRange());
                 row.location.end_column = row.location.start_column + var_decl->getNameAsString().length() - 1;
                 db.insert(row);
@@ -491,13 +927,17 @@ class IndexerVisitor : public RecursiveASTVisitor<IndexerVisitor> {
     }
 
     bool VisitCallExpr(CallExpr *expr) {
+        if (!extracts(Config::EXTRACT_CALLS)) {
+            return true;
+        }
+
         if (FunctionDecl *decl = expr->getDirectCallee()) {
-            auto fe = source_manager_->getFileEntryForID(source_manager_->getFileID(expr->getExprLoc()));
-            if (fe) {
+            db::Id file_id = file_id_of(source_manager_->getFileID(expr->getExprLoc()));
+            if (file_id > 0) {
                 auto &db = indexer_.db();
                 db::FCall row;
-                row.func_id = db.get_func_id(signature_of(decl));
-                row.location.file = fe->getName();
+                row.func_id = func_id_of(decl);
+                row.location.file_id = file_id;
                 set_range(row.location, expr->getSourceRange());
                 db.insert(row);
             }
@@ -506,6 +946,10 @@ class IndexerVisitor : public RecursiveASTVisitor<IndexerVisitor> {
     }
 
     bool VisitFieldDecl(FieldDecl *field) {
+        if (!extracts(Config::EXTRACT_VARS)) {
+            return true;
+        }
+
         if (RecordDecl *decl = field->getParent()) {
             auto &db = indexer_.db();
             db::VarDecl row;
@@ -514,20 +958,23 @@ class IndexerVisitor : public RecursiveASTVisitor<IndexerVisitor> {
             row.location = location_of(field);
             row.type_id = insert_type(field->getType());
             row.name = field->getNameAsString();
-            indexer_.db().insert(row);
+            var_ids_[field] = indexer_.db().insert(row);
         }
         return true;
     }
 
     bool VisitMemberExpr(MemberExpr *expr) {
+        if (!extracts(Config::EXTRACT_REFS)) {
+            return true;
+        }
+
         if (FieldDecl *field = dyn_cast<FieldDecl>(expr->getMemberDecl())) {
-            auto fe = source_manager_->getFileEntryForID(source_manager_->getFileID(expr->getExprLoc()));
-            if (fe) {
+            db::Id file_id = file_id_of(source_manager_->getFileID(expr->getExprLoc()));
+            if (file_id > 0) {
                 auto &db = indexer_.db();
                 db::VarRef row;
-                db::Location var_loc = location_of(field);
-                row.var_id = db.get_var_id(var_loc.file, var_loc.end_line, var_loc.end_column);
-                row.location.file = fe->getName();
+                row.var_id = var_id_of(field);
+                row.location.file_id = file_id;
                 set_range(row.location, expr->getSourceRange());
                 row.location.end_column = row.location.start_column + field->getNameAsString().length() - 1;
                 db.insert(row);
@@ -536,56 +983,161 @@ class IndexerVisitor : public RecursiveASTVisitor<IndexerVisitor> {
         return true;
     }
 
+    // Variables in rejected files are never written (see TraverseDecl), so
+    // they are not looked up and their files get no row.
+    db::Id var_id_of(const Decl *d) {
+        auto it = var_ids_.find(d);
+        if (it != var_ids_.end()) {
+            return it->second;
+        }
+        if (!file_info(d).accepted) {
+            return 0;
+        }
+
+        // Written by an earlier translation unit.
+        db::Location location = location_of(d);
+        db::Id id = indexer_.db().get_var_id(location.file_id, location.end_line, location.end_column);
+        if (id > 0) {
+            var_ids_[d] = id;
+        }
+        return id;
+    }
+
+    db::Id func_id_of(const FunctionDecl *d) {
+        const FunctionDecl *canonical = d->getCanonicalDecl();
+        auto it = func_ids_.find(canonical);
+        if (it != func_ids_.end()) {
+            return it->second;
+        }
+
+        // Written by an earlier translation unit.
+        db::Id id = indexer_.db().get_func_id(signature_of(d));
+        if (id > 0) {
+            func_ids_[canonical] = id;
+        }
+        return id;
+    }
+
     db::Comment comment_of(const Decl *d) {
         db::Comment comment;
+        if (config.comments == Config::COMMENTS_NONE) {
+            return comment;
+        }
         const auto *rc = d->getASTContext().getRawCommentForDeclNoCache(d);
         if (rc) {
-            comment.raw = rc->getRawText(*source_manager_).str();
+            if (config.comments == Config::COMMENTS_FULL) {
+                comment.raw = rc->getRawText(*source_manager_).str();
+            }
             comment.brief = rc->getBriefText(context_);
         }
         return comment;
     }
 
-    static const clang::FileEntry *getFileEntryForDecl(const clang::Decl *decl, clang::SourceManager *sm) {
-        if (!decl || !sm) {
-            return 0;
-        }
-        return sm->getFileEntryForID(sm->getFileID(decl->getLocation()));
-    }
-
   private:
     ASTContext &context_;
     SourceManager *source_manager_;
+    Preprocessor &preprocessor_;
+    HeaderSearch &header_search_;
     Indexer &indexer_;
+
+    // Guarded headers traversed in this translation unit, registered with
+    // the Indexer once it is written.
+    Indexer::IndexedFiles &files_;
+    std::unordered_map<unsigned, bool> indexed_files_;
+
+    // Hash of the predefines buffer: the target's macros and the -D, -U and
+    // -include options of the command line.
+    int64_t macro_context_;
+
+    // Filled while preprocessing; listed by file in finish().
+    std::shared_ptr<MacroUses> macro_uses_;
+    std::map<FileID, std::string> macros_;
+
+    struct TraversedFile {
+        FileID fid;
+        const FileEntry *entry;
+        std::string path;
+        int64_t hash;
+    };
+    std::vector<TraversedFile> traversed_files_;
+    std::unordered_map<const FileEntry *, int64_t> content_hashes_;
+
+    // By FileID::getHashValue().
+    std::unordered_map<unsigned, FileInfo> file_infos_;
+
+    PrintingPolicy signature_policy_;
+
+    // Per translation unit caches: type_id by QualType::getAsOpaquePtr(),
+    // signatures by canonical QualType and by function.
+    std::unordered_map<void *, db::Id> type_ids_;
+    size_t type_lookups_;
+    size_t type_hits_;
+    std::unordered_map<void *, std::string> type_signatures_;
+    std::unordered_map<const FunctionDecl *, std::string> func_signatures_;
+
+    // Row ids of the variables and fields written or looked up in this TU,
+    // and of functions by canonical decl, so references resolve without
+    // recomputing locations or signatures.
+    std::unordered_map<const Decl *, db::Id> var_ids_;
+    std::unordered_map<const FunctionDecl *, db::Id> func_ids_;
 };
 
 class IndexerASTConsumer : public clang::ASTConsumer {
   public:
-    IndexerASTConsumer(ASTContext &context, SourceManager *source_manager, Indexer &builder)
-        : visitor(context, source_manager, builder) {}
+    IndexerASTConsumer(ASTContext &context, SourceManager *source_manager, Preprocessor &preprocessor,
+                       Indexer &builder, Indexer::IndexedFiles &files, int64_t macro_context,
+                       std::shared_ptr<MacroUses> macro_uses)
+        : visitor(context, source_manager, preprocessor, builder, files, macro_context, macro_uses),
+          delay_templates(context.getLangOpts().DelayedTemplateParsing) {}
 
   private:
+    // Top-level decls are indexed as soon as they are parsed, so extraction
+    // (and, with --async-writes, the writes) overlap parsing the rest of the
+    // translation unit. Class definitions arrive complete, inline method
+    // bodies included; implicit members are never visited.
+    virtual bool HandleTopLevelDecl(clang::DeclGroupRef group) {
+        for (Decl *d : group) {
+            if (delay_templates) {
+                // Template bodies are only parsed at the end of the TU.
+                deferred.push_back(d);
+            } else {
+                visitor.TraverseDecl(d);
+            }
+        }
+        return true;
+    }
+
     virtual void HandleTranslationUnit(clang::ASTContext &context) {
-        visitor.TraverseDecl(context.getTranslationUnitDecl());
+        for (Decl *d : deferred) {
+            visitor.TraverseDecl(d);
+        }
+        visitor.finish();
     }
 
     IndexerVisitor visitor;
+    bool delay_templates;
+    std::vector<Decl *> deferred;
 };
 
 class IndexerAction : public clang::ASTFrontendAction {
   private:
     virtual std::unique_ptr<clang::ASTConsumer> CreateASTConsumer(clang::CompilerInstance &compiler,
             llvm::StringRef inFile) {
+        clang::Preprocessor &preprocessor = compiler.getPreprocessor();
+        auto macro_uses = std::make_shared<MacroUses>();
+        preprocessor.addPPCallbacks(std::make_unique<MacroUseRecorder>(preprocessor, macro_uses));
         std::unique_ptr<clang::ASTConsumer> consumer(
-            new IndexerASTConsumer(compiler.getASTContext(), &compiler.getSourceManager(), indexer_));
+            new IndexerASTConsumer(compiler.getASTContext(), &compiler.getSourceManager(), preprocessor, indexer_,
+                                   files_, hash_contents(preprocessor.getPredefines()), macro_uses));
         return consumer;
     }
 
   public:
-    IndexerAction(Indexer &builder) : indexer_(builder) {}
+    IndexerAction(Indexer &builder, Indexer::IndexedFiles &files) : indexer_(builder), files_(files) {}
 
   private:
     Indexer &indexer_;
+    Indexer::IndexedFiles &files_;
 };
 
 static const char *to_string(const AccessSpecifier access) {
@@ -602,12 +1154,256 @@ static const char *to_string(const AccessSpecifier access) {
     return "?";
 }
 
-bool Indexer::run(std::vector<std::string> &options) {
-    clang::FileManager *file_manager = new clang::FileManager(clang::FileSystemOptions());
-    clang::tooling::ToolInvocation tool_invocation(options, std::make_unique<IndexerAction>(*this), file_manager);
+static llvm::IntrusiveRefCntPtr<clang::FileManager> make_file_manager() {
+    // Unlike the default real file system, a physical file system keeps its
+    // own working directory, which run_command() moves between entries.
+    llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs(llvm::vfs::createPhysicalFileSystem().release());
+    return new clang::FileManager(clang::FileSystemOptions(), fs);
+}
+
+Indexer::Indexer(db::Database &db) : db_(db), file_manager_(make_file_manager()) {}
+
+Indexer::~Indexer() {}
+
+bool Indexer::parse(std::vector<std::string> &options, clang::FileManager *file_manager, IndexedFiles &files) {
+    clang::tooling::ToolInvocation tool_invocation(options, std::make_unique<IndexerAction>(*this, files),
+                                                   file_manager);
     return tool_invocation.run();
 }
 
+bool Indexer::run(std::vector<std::string> &options) {
+    IndexedFiles files;
+
+    // Each translation unit is written in one transaction so a failed run
+    // does not leave half of its rows behind. With --commit-every, the
+    // rollback removes the rows of the files it wrote instead.
+    db_.begin();
+    bool success = parse(options, file_manager_.get(), files);
+    if (success) {
+        success = db_.commit() == 0;
+    } else {
+        db_.rollback();
+        forget_failed(files);
+    }
+    if (success) {
+        set_indexed(files);
+    }
+    return success;
+}
+
+bool Indexer::find_indexed(const std::string &path, IndexedFile &file) {
+    std::lock_guard<std::mutex> lock(indexed_mutex_);
+    auto it = indexed_files_.find(path);
+    if (it == indexed_files_.end()) {
+        return false;
+    }
+    file = it->second;
+    return true;
+}
+
+void Indexer::refresh(db::Id file_id) {
+    std::lock_guard<std::mutex> lock(refresh_mutex_);
+    if (refreshed_files_.insert(file_id).second) {
+        db_.remove_file_rows(file_id);
+    }
+}
+
+// A translation unit is unchanged when every file it read last time still
+// has the same size and modification time or, failing that, the same
+// contents. A file without a hash lost its rows to a failed translation unit.
+bool Indexer::is_unchanged(const clang::tooling::CompileCommand &command) {
+    auto files = db_.get_dependencies(command.Filename);
+    if (files.empty()) {
+        return false;
+    }
+    for (const auto &file : files) {
+        if (file.second.hash == 0) {
+            return false;
+        }
+        llvm::SmallString<256> path(file.first);
+        llvm::sys::fs::make_absolute(command.Directory, path);
+        llvm::sys::fs::file_status status;
+        if (llvm::sys::fs::status(path, status)) {
+            return false;
+        }
+        if ((int64_t)status.getSize() == file.second.size &&
+            to_nanoseconds(status.getLastModificationTime()) == file.second.mtime) {
+            continue;
+        }
+        auto buffer = llvm::MemoryBuffer::getFile(path);
+        if (!buffer || hash_contents(buffer.get()->getBuffer()) != file.second.hash) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void Indexer::set_indexed(const IndexedFiles &files) {
+    std::lock_guard<std::mutex> lock(indexed_mutex_);
+    for (const auto &file : files) {
+        indexed_files_[file.first] = file.second;
+    }
+}
+
+bool Indexer::run_command(const clang::tooling::CompileCommand &command, clang::FileManager *file_manager,
+                          IndexedFiles &files) {
+    if (file_manager->getVirtualFileSystem().setCurrentWorkingDirectory(command.Directory)) {
+        std::cerr << "Error: cannot change directory to '" << command.Directory << "'\n";
+        return false;
+    }
+
+    if (config.verbose) {
+        printf("Indexing %s\n", command.Filename.c_str());
+    }
+
+    // The same adjustments ClangTool makes: parse only, write nothing.
+    auto adjuster = clang::tooling::combineAdjusters(
+        clang::tooling::getClangStripOutputAdjuster(),
+        clang::tooling::combineAdjusters(clang::tooling::getClangSyntaxOnlyAdjuster(),
+                                         clang::tooling::getClangStripDependencyFileAdjuster()));
+    auto options = adjuster(command.CommandLine, command.Filename);
+
+    if (!parse(options, file_manager, files)) {
+        std::cerr << "Failed to index '" << command.Filename << "'\n";
+        return false;
+    }
+    return true;
+}
+
+namespace {
+
+// One worker's share of the translation units. The owner takes from the
+// front; workers that run out steal from the back.
+struct WorkQueue {
+    std::mutex mutex;
+    std::deque<size_t> items;
+};
+
+}  // namespace
+
+static bool take_work(std::vector<WorkQueue> &queues, size_t self, size_t &item) {
+    for (size_t i = 0; i < queues.size(); i++) {
+        auto &queue = queues[(self + i) % queues.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.items.empty()) {
+            continue;
+        }
+        if (i == 0) {
+            item = queue.items.front();
+            queue.items.pop_front();
+        } else {
+            item = queue.items.back();
+            queue.items.pop_back();
+        }
+        return true;
+    }
+    return false;
+}
+
+bool Indexer::run_compdb(const std::string &dir) {
+    std::string error;
+    auto compdb = clang::tooling::CompilationDatabase::autoDetectFromDirectory(dir, error);
+    if (!compdb) {
+        std::cerr << "Error: " << error << "\n";
+        return false;
+    }
+
+    // With --shard, entries are dealt round-robin so each shard gets a similar
+    // share of every directory.
+    std::vector<clang::tooling::CompileCommand> commands;
+    size_t position = 0;
+    for (auto &command : compdb->getAllCompileCommands()) {
+        bool found = config.compdb_filters.size() == 0;
+        for (const auto &filter : config.compdb_filters) {
+            if (command.Filename.find(filter) != std::string::npos) {
+                found = true;
+                break;
+            }
+        }
+        if (found && position++ % config.shard_count == (size_t)config.shard_index) {
+            if (is_unchanged(command)) {
+                if (config.verbose) {
+                    printf("Skipping unchanged %s\n", command.Filename.c_str());
+                }
+                continue;
+            }
+            commands.push_back(std::move(command));
+        }
+    }
+
+    size_t jobs = std::max(1, std::min(config.jobs, (int)commands.size()));
+
+    if (jobs == 1) {
+        bool success = true;
+        for (const auto &command : commands) {
+            IndexedFiles files;
+            db_.begin();
+            if (run_command(command, file_manager_.get(), files) && db_.commit() == 0) {
+                set_indexed(files);
+            } else {
+                // The rollback restores the rows of the files it refreshed
+                // or, with --commit-every, removes those of every file it wrote.
+                db_.rollback();
+                forget_failed(files);
+                success = false;
+            }
+        }
+        return success;
+    }
+
+    // Translation units overlap in one transaction, so a failed one cannot
+    // be rolled back on its own; its rows are kept, but not its dependencies.
+    std::vector<WorkQueue> queues(jobs);
+    for (size_t i = 0; i < commands.size(); i++) {
+        queues[i * jobs / commands.size()].items.push_back(i);
+    }
+
+    std::atomic<bool> success(true);
+    std::vector<std::thread> workers;
+
+    db_.begin();
+    for (size_t w = 0; w < jobs; w++) {
+        workers.emplace_back([this, &queues, &commands, &success, w]() {
+            // FileManager is not thread safe.
+            auto file_manager = make_file_manager();
+            size_t i;
+            while (take_work(queues, w, i)) {
+                IndexedFiles files;
+                if (run_command(commands[i], file_manager.get(), files)) {
+                    set_indexed(files);
+                } else {
+                    success = false;
+                }
+            }
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    if (db_.commit() != 0) {
+        success = false;
+    }
+
+    return success;
+}
+
+// The rollback gives the files refreshed by the failed translation unit
+// their old rows back. With --commit-every, it removes the rows of every file
+// the translation unit wrote instead, so the guarded headers it traversed
+// are no longer indexed either, whichever translation unit registered them.
+void Indexer::forget_failed(const IndexedFiles &files) {
+    {
+        std::lock_guard<std::mutex> lock(refresh_mutex_);
+        refreshed_files_.clear();
+    }
+    if (config.commit_every > 0) {
+        std::lock_guard<std::mutex> lock(indexed_mutex_);
+        for (const auto &file : files) {
+            indexed_files_.erase(file.first);
+        }
+    }
+}
+
 bool Indexer::accept(const char *filename) {
     if (!filename || !filename[0]) {
         return false;
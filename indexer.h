@@ -1,21 +1,77 @@
 #pragma once
 
+#include <mutex>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include <llvm/ADT/IntrusiveRefCntPtr.h>
+
 #include "db.h"
 
+namespace clang {
+class FileManager;
+namespace tooling {
+struct CompileCommand;
+}
+}
+
 class Indexer {
+  public:
+    // An include-guarded header as a translation unit indexed it: its content
+    // hash combined with the macros it was indexed with, and the macros it
+    // tests or expands, whose definitions the combined hash covers.
+    struct IndexedFile {
+        int64_t hash;
+        std::string macros;
+    };
+    using IndexedFiles = std::unordered_map<std::string, IndexedFile>;
+
   private:
     db::Database& db_;
 
+    // Shared by every translation unit of a run, so headers are only looked
+    // up and read once.
+    llvm::IntrusiveRefCntPtr<clang::FileManager> file_manager_;
+
+    // Include-guarded headers written by earlier translation units.
+    std::mutex indexed_mutex_;
+    IndexedFiles indexed_files_;
+
+    // Files whose rows from an earlier run were removed by this one. Held
+    // while they are removed, so no translation unit writes to a file before
+    // its old rows are gone.
+    std::mutex refresh_mutex_;
+    std::unordered_set<db::Id> refreshed_files_;
+
+    bool parse(std::vector<std::string>& options, clang::FileManager* file_manager, IndexedFiles& files);
+    bool run_command(const clang::tooling::CompileCommand& command, clang::FileManager* file_manager,
+                     IndexedFiles& files);
+    void set_indexed(const IndexedFiles& files);
+    void forget_failed(const IndexedFiles& files);
+    bool is_unchanged(const clang::tooling::CompileCommand& command);
+
   public:
-    Indexer(db::Database& db) : db_(db) {}
+    Indexer(db::Database& db);
+    ~Indexer();
 
     db::Database& db() {
         return db_;
     }
 
     bool accept(const char* filename);
+    bool find_indexed(const std::string& path, IndexedFile& file);
+
+    // Removes the old rows of `file_id` for the first translation unit of
+    // the run to ask; the others wait until they are removed.
+    void refresh(db::Id file_id);
+
     bool run(std::vector<std::string>& options);
+
+    // Indexes every entry of the compilation database in `dir` whose file
+    // name contains one of config.compdb_filters (all entries if empty), on
+    // config.jobs threads. Entries whose files are unchanged since the last
+    // run are skipped.
+    bool run_compdb(const std::string& dir);
 };
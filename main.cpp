@@ -1,9 +1,50 @@
+#include <cstdio>
 #include <iostream>
 
 #include "config.h"
 #include "indexer.h"
+#include "merge.h"
 #include "util.h"
 
+// Parses a comma separated --extract list into Config::Extract flags; returns
+// 0 for an unknown name.
+static unsigned parse_extract(const std::string &list) {
+    unsigned extract = 0;
+    size_t start = 0;
+    while (start <= list.size()) {
+        size_t end = list.find(',', start);
+        if (end == std::string::npos) {
+            end = list.size();
+        }
+        std::string name = list.substr(start, end - start);
+        unsigned flag = 0;
+        for (const auto &entry : extract_names) {
+            if (name == entry.name) {
+                flag = entry.flag;
+            }
+        }
+        if (flag == 0) {
+            return 0;
+        }
+        extract |= flag;
+        start = end + 1;
+    }
+    return extract;
+}
+
+static std::string extract_to_string(unsigned extract) {
+    std::string result;
+    for (const auto &entry : extract_names) {
+        if (extract & entry.flag) {
+            if (!result.empty()) {
+                result += ",";
+            }
+            result += entry.name;
+        }
+    }
+    return result;
+}
+
 static int parse_options(int argc, char **argv, std::vector<std::string> &compiler_options) {
 #define check_arg(arg)                                                    \
     do                                                                    \
@@ -31,6 +72,69 @@ static int parse_options(int argc, char **argv, std::vector<std::string> &compil
                 config.accept_paths.push_back(argv[++i]);
             } else if (arg == "--verbose") {
                 config.verbose = true;
+            } else if (arg == "--commit-every") {
+                check_arg(arg);
+                config.commit_every = atoi(argv[++i]);
+                if (config.commit_every <= 0) {
+                    std::cerr << "Error: invalid argument for '" << arg << "'\n";
+                    return 1;
+                }
+            } else if (arg == "--fast-load") {
+                config.fast_load = true;
+            } else if (arg == "--defer-indexes") {
+                config.defer_indexes = true;
+            } else if (arg == "--async-writes") {
+                config.async_writes = true;
+            } else if (arg == "--hash-ids") {
+                config.hash_ids = true;
+            } else if (arg == "--compdb") {
+                check_arg(arg);
+                config.compdb_dir = argv[++i];
+            } else if (arg == "--filter") {
+                check_arg(arg);
+                config.compdb_filters.push_back(argv[++i]);
+            } else if (arg == "--remove") {
+                check_arg(arg);
+                config.remove_paths.push_back(argv[++i]);
+            } else if (arg.compare(0, 11, "--comments=") == 0) {
+                std::string mode = arg.substr(11);
+                if (mode == "none") {
+                    config.comments = Config::COMMENTS_NONE;
+                } else if (mode == "brief") {
+                    config.comments = Config::COMMENTS_BRIEF;
+                } else if (mode == "full") {
+                    config.comments = Config::COMMENTS_FULL;
+                } else {
+                    std::cerr << "Error: invalid argument for '--comments'\n";
+                    return 1;
+                }
+            } else if (arg == "--extract") {
+                check_arg(arg);
+                config.extract = parse_extract(argv[++i]);
+                if (config.extract == 0) {
+                    std::cerr << "Error: invalid argument for '" << arg << "'\n";
+                    return 1;
+                }
+                if ((config.extract & Config::EXTRACT_TYPES) && !(config.extract & Config::EXTRACT_TYPE_USERS)) {
+                    std::cerr << "Error: '--extract types' needs decls, funcs, vars or locals, whose types it writes\n";
+                    return 1;
+                }
+            } else if (arg == "--reindex-headers") {
+                config.skip_indexed_headers = false;
+            } else if (arg == "--shard") {
+                check_arg(arg);
+                if (sscanf(argv[++i], "%d/%d", &config.shard_index, &config.shard_count) != 2 ||
+                    config.shard_count <= 0 || config.shard_index < 0 || config.shard_index >= config.shard_count) {
+                    std::cerr << "Error: invalid argument for '" << arg << "'\n";
+                    return 1;
+                }
+            } else if (arg == "-j" || arg == "--jobs") {
+                check_arg(arg);
+                config.jobs = atoi(argv[++i]);
+                if (config.jobs <= 0) {
+                    std::cerr << "Error: invalid argument for '" << arg << "'\n";
+                    return 1;
+                }
             } else {
                 std::cerr << "Unknown option: '" << arg << "'\n";
                 return 1;
@@ -42,7 +146,45 @@ static int parse_options(int argc, char **argv, std::vector<std::string> &compil
 
 static void print_usage(const char *app);
 
+// ctypefind merge [OPTIONS] <out.db> <shard.db>...
+static int merge_main(int argc, char **argv) {
+    std::vector<std::string> paths;
+    for (int i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-j" || arg == "--jobs") {
+            if (i == argc - 1 || (config.jobs = atoi(argv[++i])) <= 0) {
+                std::cerr << "Error: invalid argument for '" << arg << "'\n";
+                return 1;
+            }
+        } else if (arg == "--verbose") {
+            config.verbose = true;
+        } else if (arg == "--fast-load") {
+            config.fast_load = true;
+        } else if (arg == "--async-writes") {
+            config.async_writes = true;
+        } else if (arg.compare(0, 1, "-") == 0) {
+            std::cerr << "Unknown option: '" << arg << "'\n";
+            return 1;
+        } else {
+            paths.push_back(arg);
+        }
+    }
+
+    if (paths.size() < 2) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    std::string out = paths[0];
+    paths.erase(paths.begin());
+    return merge(out, paths, config.jobs);
+}
+
 int main(int argc, char **argv) {
+    if (argc > 1 && std::string(argv[1]) == "merge") {
+        return merge_main(argc, argv);
+    }
+
     std::vector<std::string> options;
 
     int options_error = parse_options(argc, argv, options);
@@ -50,34 +192,135 @@ int main(int argc, char **argv) {
         return options_error;
     }
 
-    if (options.size() == 0) {
+    if (options.size() == 0 && config.compdb_dir.empty() && config.remove_paths.empty()) {
         print_usage(argv[0]);
         return 1;
     }
 
-    db::Database db(config.db_name);
+    if (options.size() > 0 && !config.compdb_dir.empty()) {
+        std::cerr << "Error: compiler options cannot be used with '--compdb'\n";
+        return 1;
+    }
+
+    if (config.compdb_filters.size() > 0 && config.compdb_dir.empty()) {
+        std::cerr << "Error: '--filter' requires '--compdb'\n";
+        return 1;
+    }
+
+    if (config.jobs > 1 && config.compdb_dir.empty()) {
+        std::cerr << "Error: '--jobs' requires '--compdb'\n";
+        return 1;
+    }
+
+    if (config.shard_count > 1 && config.compdb_dir.empty()) {
+        std::cerr << "Error: '--shard' requires '--compdb'\n";
+        return 1;
+    }
+
+    if (config.defer_indexes && !config.truncate) {
+        std::cerr << "Error: '--defer-indexes' requires '--truncate'\n";
+        return 1;
+    }
+
+    db::Options db_options;
+    db_options.fast_load = config.fast_load;
+    db_options.defer_indexes = config.defer_indexes;
+    db_options.async_writes = config.async_writes;
+    db_options.hash_ids = config.hash_ids;
+
+    db::Database db(config.db_name, db_options);
+    if (!db.is_open()) {
+        std::cerr << "Failed to open '" << config.db_name << "'\n";
+        return 1;
+    }
+
+    if (db.is_outdated() && !config.truncate) {
+        std::cerr << "Error: '" << config.db_name << "' was written by an older version; use '--truncate'\n";
+        return 1;
+    }
 
     if (config.truncate && db.clear() != 0) {
         std::cerr << "Failed to truncate '" << config.db_name << "'\n";
         return 1;
     }
 
+    // Rows written by earlier runs stay, so the database holds everything
+    // their profiles extracted as well. Their ids must come from the same
+    // scheme as the new rows' ids, or the two could collide.
+    const char *ids = config.hash_ids ? "hash" : "sequential";
+    std::string stored;
+    if (db.get_meta("ids", stored) && stored != ids) {
+        std::cerr << "Error: '" << config.db_name << "' was written " << (config.hash_ids ? "without" : "with")
+                  << " '--hash-ids'; use the same option or '--truncate'\n";
+        return 1;
+    }
+
+    unsigned extract = config.extract;
+    if (db.get_meta("extract", stored)) {
+        extract |= parse_extract(stored);
+    }
+
+    if (db.set_meta("extract", extract_to_string(extract)) != 0 ||
+        db.set_meta("ids", ids) != 0) {
+        std::cerr << "Failed to write metadata to '" << config.db_name << "'\n";
+        return 1;
+    }
+
+    db.set_commit_interval(config.commit_every);
+
+    // Files deleted from the project go before anything is indexed.
+    for (const auto &path : config.remove_paths) {
+        if (db.remove_file(path) != 0) {
+            std::cerr << "Failed to remove '" << path << "' from '" << config.db_name << "'\n";
+            return 1;
+        }
+    }
+
     Indexer indexer(db);
 
-    bool success = indexer.run(options);
+    bool success = true;
+    if (!config.compdb_dir.empty()) {
+        success = indexer.run_compdb(config.compdb_dir);
+    } else if (options.size() > 0) {
+        success = indexer.run(options);
+    }
+
+    if (db.finish() != 0) {
+        std::cerr << "Failed to finish '" << config.db_name << "'\n";
+        success = false;
+    }
 
     return success ? 0 : 1;
 }
 
 static void print_usage(const char *app) {
     std::cout << "Usage: " << app << " [OPTIONS] -- <COMPILER OPTIONS>\n";
+    std::cout << "       " << app << " [OPTIONS] --compdb <dir>\n";
+    std::cout << "       " << app << " merge [-j <n>] [--verbose] [--fast-load] [--async-writes] <out.db> <shard.db>...\n";
 
     std::cout << "\n";
     std::cout << "OPTIONS:\n";
-    std::cout << "--db <dbname>\tDatabase name\n";
+    std::cout << "--db <dbname>\tDatabase name; other processes wait for its transactions, so prefer -j or --shard\n";
     std::cout << "--accept <str>\tOnly file names containing <str> will be accepted\n";
     std::cout << "--truncate\tTruncate existing tables";
     std::cout << "--verbose\tPrints file names visited\n";
+    std::cout << "--commit-every <n>\tCommit after every <n> rows instead of once per translation unit; the files\n"
+                 "\t\ta failed translation unit wrote to then lose their rows until they are indexed again\n";
+    std::cout << "--fast-load\tSkip journal syncs while loading (the database may be lost on a crash)\n";
+    std::cout << "--defer-indexes\tWith --truncate, build unique indexes once after loading\n";
+    std::cout << "--async-writes\tWrite to the database on a separate thread while parsing\n";
+    std::cout << "--hash-ids\tUse hashes of the rows' unique keys as ids, so shards can be merged without remapping;\n"
+                 "\t\tan existing database must have been written with the same option unless --truncate is given\n";
+    std::cout << "--compdb <dir>\tIndex every entry of <dir>/compile_commands.json in one process, skipping unchanged entries\n";
+    std::cout << "--filter <str>\tWith --compdb, only index files whose name contains <str>\n";
+    std::cout << "-j, --jobs <n>\tWith --compdb, index <n> translation units in parallel; with merge, read <n> shards ahead\n";
+    std::cout << "--remove <path>\tDelete a file, as it was indexed, and every row that comes from it\n";
+    std::cout << "--shard <i>/<n>\tWith --compdb, only index every <n>th entry starting at <i> (0-based)\n";
+    std::cout << "--reindex-headers\tTraverse include-guarded headers again in every translation unit, not only in those\n"
+                 "\t\twhere the macros they test or expand are defined otherwise than where they were indexed\n";
+    std::cout << "--extract <list>\tComma separated subset of decls,types,funcs,calls,refs,vars,locals (default: all);\n"
+                 "\t\ttypes are those of the fields, functions and variables of decls,funcs,vars,locals\n";
+    std::cout << "--comments=<mode>\tStore doc comments: none (default), brief, or full (brief and raw text)\n";
 
     std::cout << "\n";
     std::cout << "COMPILER OPTIONS:\tOptions for C++ compiler (clang)\n";
@@ -85,4 +328,7 @@ static void print_usage(const char *app) {
     std::cout << "\n";
     std::cout << "Example:\n";
     std::cout << app << " --db app.db --accept app/ -- -std=c++17 -I/usr/local/include -c app/main.cpp\n";
+    std::cout << app << " --db app.db --accept /src/app/ --compdb /src/app/build\n";
+    std::cout << app << " --db shard0.db --truncate --shard 0/2 --compdb /src/app/build\n";
+    std::cout << app << " merge app.db shard0.db shard1.db\n";
 }
\ No newline at end of file
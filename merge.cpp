@@ -0,0 +1,601 @@
+#include "merge.h"
+
+#include <sqlite3.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <deque>
+#include <future>
+#include <iostream>
+#include <unordered_map>
+
+#include "config.h"
+#include "db.h"
+#include "util.h"
+
+namespace {
+
+// Rows of one shard as written by db::Database, still carrying the shard's
+// own ids.
+struct Shard {
+    std::string path;
+    std::string error;
+
+    std::vector<std::pair<db::Id, std::string>> files;
+    std::unordered_map<db::Id, db::FileStamp> stamps;
+    std::vector<std::pair<db::Id, db::Id>> dependencies;  // tu_id, file_id
+    std::vector<db::Decl> decls;
+    std::vector<db::TemplateParam> template_params;
+    std::vector<db::DeclBase> decl_bases;
+    std::vector<db::DeclField> decl_fields;
+    std::vector<db::EnumField> enum_fields;
+    std::vector<db::Type> types;
+    std::vector<db::TypeArgument> type_arguments;
+    std::vector<db::Function> funcs;
+    std::vector<db::FunctionParam> func_params;
+    std::vector<db::MethodOverride> method_overrides;
+    std::vector<db::VarDecl> var_decls;
+    std::vector<db::VarRef> var_refs;
+    std::vector<db::FCall> fcalls;
+};
+
+// Maps shard ids to merged ids.
+class IdMap {
+  private:
+    std::unordered_map<db::Id, db::Id> ids_;
+
+  public:
+    void set(db::Id from, db::Id to) {
+        if (from > 0) {
+            ids_[from] = to;
+        }
+    }
+
+    // Returns 0 for a null reference or an id the shard didn't define.
+    db::Id operator[](db::Id from) const {
+        auto it = ids_.find(from);
+        return it != ids_.end() ? it->second : 0;
+    }
+};
+
+using Meta = std::vector<std::pair<std::string, std::string>>;
+
+std::string text(sqlite3_stmt *stmt, int column) {
+    const char *value = (const char *)sqlite3_column_text(stmt, column);
+    return value ? value : "";
+}
+
+int integer(sqlite3_stmt *stmt, int column) {
+    return sqlite3_column_int(stmt, column);
+}
+
+db::Id row_id(sqlite3_stmt *stmt, int column) {
+    return sqlite3_column_int64(stmt, column);
+}
+
+void read_location(sqlite3_stmt *stmt, int column, db::Location &location) {
+    location.file_id = row_id(stmt, column);
+    location.start_line = integer(stmt, column + 1);
+    location.end_line = integer(stmt, column + 2);
+    location.start_column = integer(stmt, column + 3);
+    location.end_column = integer(stmt, column + 4);
+}
+
+// Runs `sql` and calls `fn` for every row; returns false after setting
+// shard.error if the query fails.
+template <class Fn>
+bool query(sqlite3 *db, Shard &shard, const char *sql, Fn fn) {
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+        shard.error = sqlite3_errmsg(db);
+        return false;
+    }
+
+    int result;
+    while ((result = sqlite3_step(stmt)) == SQLITE_ROW) {
+        fn(stmt);
+    }
+    if (result != SQLITE_DONE) {
+        shard.error = sqlite3_errmsg(db);
+    }
+
+    sqlite3_finalize(stmt);
+    return result == SQLITE_DONE;
+}
+
+using Comments = std::unordered_map<std::string, std::unordered_map<db::Id, db::Comment>>;
+
+db::Comment comment_of(Comments &comments, const char *owner_type, db::Id owner_id) {
+    auto it = comments.find(owner_type);
+    if (it == comments.end()) {
+        return db::Comment();
+    }
+    auto comment = it->second.find(owner_id);
+    return comment != it->second.end() ? std::move(comment->second) : db::Comment();
+}
+
+Shard read_shard(const std::string &path) {
+    Shard shard;
+    shard.path = path;
+
+    sqlite3 *db;
+    if (sqlite3_open_v2(path.c_str(), &db, SQLITE_OPEN_READONLY, nullptr) != SQLITE_OK) {
+        shard.error = sqlite3_errmsg(db);
+        sqlite3_close(db);
+        return shard;
+    }
+
+    Comments comments;
+
+    bool ok =
+        query(db, shard, "select owner_type, owner_id, brief_comment, comment from comment",
+              [&](sqlite3_stmt *stmt) {
+                  db::Comment &comment = comments[text(stmt, 0)][row_id(stmt, 1)];
+                  comment.brief = text(stmt, 2);
+                  comment.raw = text(stmt, 3);
+              }) &&
+        query(db, shard, "select id, path, size, mtime, hash, include_guarded, context, macros from file",
+              [&](sqlite3_stmt *stmt) {
+                  shard.files.emplace_back(row_id(stmt, 0), text(stmt, 1));
+                  db::FileStamp stamp;
+                  stamp.file_id = row_id(stmt, 0);
+                  stamp.size = sqlite3_column_int64(stmt, 2);
+                  stamp.mtime = sqlite3_column_int64(stmt, 3);
+                  stamp.hash = sqlite3_column_int64(stmt, 4);
+                  stamp.include_guarded = integer(stmt, 5);
+                  stamp.context = sqlite3_column_int64(stmt, 6);
+                  stamp.macros = text(stmt, 7);
+                  if (stamp.hash != 0) {
+                      shard.stamps[stamp.file_id] = stamp;
+                  }
+              }) &&
+        query(db, shard, "select tu_id, file_id from tu_dependency order by tu_id",
+              [&](sqlite3_stmt *stmt) { shard.dependencies.emplace_back(row_id(stmt, 0), row_id(stmt, 1)); }) &&
+        query(db, shard,
+              "select id, type, name, file_id, start_line, end_line, start_column, end_column, underlying_type, "
+              "is_struct, is_abstract, is_template, is_scoped from v_decl",
+              [&](sqlite3_stmt *stmt) {
+                  db::Decl row;
+                  row.id = row_id(stmt, 0);
+                  row.type = text(stmt, 1);
+                  row.name = text(stmt, 2);
+                  read_location(stmt, 3, row.location);
+                  row.underlying_type = text(stmt, 8);
+                  row.is_struct = integer(stmt, 9);
+                  row.is_abstract = integer(stmt, 10);
+                  row.is_template = integer(stmt, 11);
+                  row.is_scoped = integer(stmt, 12);
+                  row.comment = comment_of(comments, "decl", row.id);
+                  shard.decls.push_back(std::move(row));
+              }) &&
+        query(db, shard,
+              "select id, template_id, template_type, name, kind, type, value, is_variadic, `index` "
+              "from template_parameter",
+              [&](sqlite3_stmt *stmt) {
+                  db::TemplateParam row;
+                  row.id = row_id(stmt, 0);
+                  row.template_id = row_id(stmt, 1);
+                  row.template_type = text(stmt, 2);
+                  row.name = text(stmt, 3);
+                  row.kind = text(stmt, 4);
+                  row.type = text(stmt, 5);
+                  row.value = text(stmt, 6);
+                  row.is_variadic = integer(stmt, 7);
+                  row.index = integer(stmt, 8);
+                  shard.template_params.push_back(std::move(row));
+              }) &&
+        query(db, shard, "select id, decl_id, base_id, position, access from decl_base",
+              [&](sqlite3_stmt *stmt) {
+                  db::DeclBase row;
+                  row.id = row_id(stmt, 0);
+                  row.decl_id = row_id(stmt, 1);
+                  row.base_id = row_id(stmt, 2);
+                  row.position = integer(stmt, 3);
+                  row.access = text(stmt, 4);
+                  shard.decl_bases.push_back(std::move(row));
+              }) &&
+        query(db, shard,
+              "select id, decl_id, type_id, name, access, file_id, start_line, end_line, start_column, end_column "
+              "from decl_field",
+              [&](sqlite3_stmt *stmt) {
+                  db::DeclField row;
+                  row.id = row_id(stmt, 0);
+                  row.decl_id = row_id(stmt, 1);
+                  row.type_id = row_id(stmt, 2);
+                  row.name = text(stmt, 3);
+                  row.access = text(stmt, 4);
+                  read_location(stmt, 5, row.location);
+                  row.comment = comment_of(comments, "decl_field", row.id);
+                  shard.decl_fields.push_back(std::move(row));
+              }) &&
+        query(db, shard,
+              "select id, enum_id, name, value, file_id, start_line, end_line, start_column, end_column "
+              "from enum_field",
+              [&](sqlite3_stmt *stmt) {
+                  db::EnumField row;
+                  row.id = row_id(stmt, 0);
+                  row.enum_id = row_id(stmt, 1);
+                  row.name = text(stmt, 2);
+                  row.value = integer(stmt, 3);
+                  read_location(stmt, 4, row.location);
+                  row.comment = comment_of(comments, "enum_field", row.id);
+                  shard.enum_fields.push_back(std::move(row));
+              }) &&
+        query(db, shard, "select id, name, decl_name, decl_kind, indirection, template_parameter_index from v_type",
+              [&](sqlite3_stmt *stmt) {
+                  db::Type row;
+                  row.id = row_id(stmt, 0);
+                  row.name = text(stmt, 1);
+                  row.decl_name = text(stmt, 2);
+                  row.decl_kind = text(stmt, 3);
+                  row.indirection = text(stmt, 4);
+                  row.template_parameter_index = integer(stmt, 5);
+                  shard.types.push_back(std::move(row));
+              }) &&
+        query(db, shard, "select id, type_id, kind, value, `index`, referenced_type_id from v_type_argument",
+              [&](sqlite3_stmt *stmt) {
+                  db::TypeArgument row;
+                  row.id = row_id(stmt, 0);
+                  row.type_id = row_id(stmt, 1);
+                  row.kind = text(stmt, 2);
+                  row.value = text(stmt, 3);
+                  row.index = integer(stmt, 4);
+                  row.referenced_type_id = row_id(stmt, 5);
+                  shard.type_arguments.push_back(std::move(row));
+              }) &&
+        query(db, shard,
+              "select id, name, qual_name, signature, file_id, start_line, end_line, start_column, end_column, "
+              "decl_id, type_id, access, is_static, is_inline, is_virtual, is_pure, is_ctor, is_overriding, "
+              "is_const from v_func",
+              [&](sqlite3_stmt *stmt) {
+                  db::Function row;
+                  row.id = row_id(stmt, 0);
+                  row.name = text(stmt, 1);
+                  row.qual_name = text(stmt, 2);
+                  row.signature = text(stmt, 3);
+                  read_location(stmt, 4, row.location);
+                  row.decl_id = row_id(stmt, 9);
+                  row.type_id = row_id(stmt, 10);
+                  row.access = text(stmt, 11);
+                  row.is_static = integer(stmt, 12);
+                  row.is_inline = integer(stmt, 13);
+                  row.is_virtual = integer(stmt, 14);
+                  row.is_pure = integer(stmt, 15);
+                  row.is_ctor = integer(stmt, 16);
+                  row.is_overriding = integer(stmt, 17);
+                  row.is_const = integer(stmt, 18);
+                  row.comment = comment_of(comments, "func", row.id);
+                  shard.funcs.push_back(std::move(row));
+              }) &&
+        query(db, shard, "select id, func_id, position, type_id, name, default_value from func_param",
+              [&](sqlite3_stmt *stmt) {
+                  db::FunctionParam row;
+                  row.id = row_id(stmt, 0);
+                  row.function_id = row_id(stmt, 1);
+                  row.position = integer(stmt, 2);
+                  row.type_id = row_id(stmt, 3);
+                  row.name = text(stmt, 4);
+                  row.default_value = text(stmt, 5);
+                  shard.func_params.push_back(std::move(row));
+              }) &&
+        query(db, shard, "select id, method_id, overridden_method_id from method_override",
+              [&](sqlite3_stmt *stmt) {
+                  db::MethodOverride row;
+                  row.id = row_id(stmt, 0);
+                  row.method_id = row_id(stmt, 1);
+                  row.overridden_method_id = row_id(stmt, 2);
+                  shard.method_overrides.push_back(row);
+              }) &&
+        query(db, shard,
+              "select id, class_id, type_id, name, file_id, start_line, end_line, start_column, end_column "
+              "from var_decl",
+              [&](sqlite3_stmt *stmt) {
+                  db::VarDecl row;
+                  row.id = row_id(stmt, 0);
+                  row.class_id = row_id(stmt, 1);
+                  row.type_id = row_id(stmt, 2);
+                  row.name = text(stmt, 3);
+                  read_location(stmt, 4, row.location);
+                  shard.var_decls.push_back(std::move(row));
+              }) &&
+        query(db, shard,
+              "select id, var_id, file_id, start_line, end_line, start_column, end_column from var_ref",
+              [&](sqlite3_stmt *stmt) {
+                  db::VarRef row;
+                  row.id = row_id(stmt, 0);
+                  row.var_id = row_id(stmt, 1);
+                  read_location(stmt, 2, row.location);
+                  shard.var_refs.push_back(row);
+              }) &&
+        query(db, shard, "select id, func_id, file_id, start_line, end_line, start_column, end_column from fcall",
+              [&](sqlite3_stmt *stmt) {
+                  db::FCall row;
+                  row.id = row_id(stmt, 0);
+                  row.func_id = row_id(stmt, 1);
+                  read_location(stmt, 2, row.location);
+                  shard.fcalls.push_back(row);
+              });
+
+    if (!ok) {
+        shard.error = "'" + path + "': " + shard.error;
+    }
+
+    sqlite3_close(db);
+    return shard;
+}
+
+class Merger {
+  private:
+    db::Database &db_;
+
+    IdMap files_;
+    IdMap decls_;
+    IdMap types_;
+    IdMap funcs_;
+    IdMap vars_;
+
+    void remap(db::Location &location) {
+        location.file_id = files_[location.file_id];
+    }
+
+  public:
+    Merger(db::Database &db) : db_(db) {
+    }
+
+    // Rows that reference another table are remapped after it, and rows owned
+    // by a type or function that already existed are dropped with it.
+    void add(Shard &shard) {
+        files_ = IdMap();
+        decls_ = IdMap();
+        types_ = IdMap();
+        funcs_ = IdMap();
+        vars_ = IdMap();
+
+        for (const auto &file : shard.files) {
+            files_.set(file.first, db_.get_file_id(file.second));
+        }
+
+        // Dependencies are sorted by TU.
+        std::vector<db::FileStamp> stamps;
+        for (size_t i = 0; i < shard.dependencies.size(); i++) {
+            auto stamp = shard.stamps.find(shard.dependencies[i].second);
+            if (stamp != shard.stamps.end()) {
+                stamps.push_back(stamp->second);
+                stamps.back().file_id = files_[stamp->first];
+            }
+            db::Id tu_id = shard.dependencies[i].first;
+            if (i + 1 == shard.dependencies.size() || shard.dependencies[i + 1].first != tu_id) {
+                db_.set_dependencies(files_[tu_id], stamps);
+                stamps.clear();
+            }
+        }
+
+        for (auto &row : shard.decls) {
+            db::Id id = row.id;
+            if (row.type.empty()) {
+                // A placeholder for a decl defined elsewhere.
+                decls_.set(id, db_.get_decl_id(row.name));
+            } else {
+                remap(row.location);
+                decls_.set(id, db_.insert(row));
+            }
+        }
+
+        IdMap new_types;
+        for (auto &row : shard.types) {
+            db::Id id = row.id;
+            bool inserted = false;
+            types_.set(id, db_.insert(row, &inserted));
+            if (inserted) {
+                new_types.set(id, row.id);
+            }
+        }
+
+        for (auto &row : shard.type_arguments) {
+            if (new_types[row.type_id]) {
+                row.type_id = types_[row.type_id];
+                row.referenced_type_id = types_[row.referenced_type_id];
+                db_.insert(row);
+            }
+        }
+
+        IdMap new_funcs;
+        for (auto &row : shard.funcs) {
+            db::Id id = row.id;
+            bool inserted = false;
+            remap(row.location);
+            row.decl_id = decls_[row.decl_id];
+            row.type_id = types_[row.type_id];
+            funcs_.set(id, db_.insert(row, &inserted));
+            if (inserted) {
+                new_funcs.set(id, row.id);
+            }
+        }
+
+        for (auto &row : shard.func_params) {
+            if (new_funcs[row.function_id]) {
+                row.function_id = funcs_[row.function_id];
+                row.type_id = types_[row.type_id];
+                db_.insert(row);
+            }
+        }
+
+        for (auto &row : shard.method_overrides) {
+            if (new_funcs[row.method_id]) {
+                row.method_id = funcs_[row.method_id];
+                row.overridden_method_id = funcs_[row.overridden_method_id];
+                db_.insert(row);
+            }
+        }
+
+        for (auto &row : shard.template_params) {
+            row.template_id = row.template_type == "class" ? decls_[row.template_id] : funcs_[row.template_id];
+            db_.insert(row);
+        }
+
+        for (auto &row : shard.decl_bases) {
+            row.decl_id = decls_[row.decl_id];
+            row.base_id = decls_[row.base_id];
+            db_.insert(row);
+        }
+
+        for (auto &row : shard.decl_fields) {
+            row.decl_id = decls_[row.decl_id];
+            row.type_id = types_[row.type_id];
+            remap(row.location);
+            db_.insert(row);
+        }
+
+        for (auto &row : shard.enum_fields) {
+            row.enum_id = decls_[row.enum_id];
+            remap(row.location);
+            db_.insert(row);
+        }
+
+        for (auto &row : shard.var_decls) {
+            db::Id id = row.id;
+            row.class_id = decls_[row.class_id];
+            row.type_id = types_[row.type_id];
+            remap(row.location);
+            vars_.set(id, db_.insert(row));
+        }
+
+        for (auto &row : shard.var_refs) {
+            row.var_id = vars_[row.var_id];
+            remap(row.location);
+            db_.insert(row);
+        }
+
+        for (auto &row : shard.fcalls) {
+            row.func_id = funcs_[row.func_id];
+            remap(row.location);
+            db_.insert(row);
+        }
+    }
+};
+
+// Returns the meta rows of the database at `path`, ordered by key.
+Meta read_meta(const std::string &path) {
+    Meta meta;
+    sqlite3 *db;
+    if (sqlite3_open_v2(path.c_str(), &db, SQLITE_OPEN_READONLY, nullptr) == SQLITE_OK) {
+        Shard shard;
+        query(db, shard, "select `key`, value from meta order by `key`",
+              [&](sqlite3_stmt *stmt) { meta.emplace_back(text(stmt, 0), text(stmt, 1)); });
+    }
+    sqlite3_close(db);
+    return meta;
+}
+
+// Shards written with hash ids already agree on every id, so their rows are
+// copied as they are.
+bool copy_shards(db::Database &db, const std::vector<std::string> &shards) {
+    bool success = true;
+    for (const auto &path : shards) {
+        if (config.verbose) {
+            printf("Merging %s\n", path.c_str());
+        }
+        if (db.copy_rows(path) != 0) {
+            std::cerr << "Error: failed to merge '" << path << "'\n";
+            success = false;
+        }
+    }
+    return success;
+}
+
+// Other shards are decoded and their ids remapped. SQLite has a single
+// writer, so shards are read on up to `jobs` threads ahead of the one merging
+// them, in command line order.
+bool remap_shards(db::Database &db, const std::vector<std::string> &shards, int jobs) {
+    std::deque<std::future<Shard>> pending;
+    size_t next = 0;
+    auto read_ahead = [&]() {
+        while (next < shards.size() && pending.size() < (size_t)std::max(1, jobs)) {
+            pending.push_back(std::async(std::launch::async, read_shard, shards[next++]));
+        }
+    };
+
+    Merger merger(db);
+    bool success = true;
+
+    if (db.begin() != 0) {
+        std::cerr << "Error: failed to begin a transaction\n";
+        return false;
+    }
+    read_ahead();
+    while (!pending.empty()) {
+        Shard shard = pending.front().get();
+        pending.pop_front();
+        read_ahead();
+
+        if (!shard.error.empty()) {
+            std::cerr << "Error: " << shard.error << "\n";
+            success = false;
+            continue;
+        }
+
+        if (config.verbose) {
+            printf("Merging %s\n", shard.path.c_str());
+        }
+
+        merger.add(shard);
+    }
+
+    return db.commit() == 0 && success;
+}
+
+}  // namespace
+
+int merge(const std::string &out, const std::vector<std::string> &shards, int jobs) {
+    // The output is truncated before the shards are read.
+    for (const auto &path : shards) {
+        if (path == out || same_file(path, out)) {
+            std::cerr << "Error: '" << out << "' cannot be both the output and a shard\n";
+            return 1;
+        }
+    }
+
+    std::vector<Meta> metas;
+    bool hash_ids = true;
+    for (const auto &path : shards) {
+        metas.push_back(read_meta(path));
+        const auto &meta = metas.back();
+        hash_ids = hash_ids && std::find(meta.begin(), meta.end(), Meta::value_type("ids", "hash")) != meta.end();
+        if (meta != metas[0]) {
+            std::cerr << "Warning: '" << path << "' was written with different options\n";
+        }
+    }
+
+    // The output is rebuilt from scratch, so its unique indexes are built once
+    // at the end and duplicates are dropped in memory until then.
+    db::Options options;
+    options.fast_load = config.fast_load;
+    options.defer_indexes = true;
+    options.async_writes = config.async_writes;
+    options.hash_ids = hash_ids;
+
+    db::Database db(out.c_str(), options);
+    if (!db.is_open()) {
+        std::cerr << "Failed to open '" << out << "'\n";
+        return 1;
+    }
+    if (db.clear() != 0) {
+        std::cerr << "Failed to truncate '" << out << "'\n";
+        return 1;
+    }
+
+    bool success = hash_ids ? copy_shards(db, shards) : remap_shards(db, shards, jobs);
+
+    for (const auto &entry : metas[0]) {
+        if (db.set_meta(entry.first, entry.first == "ids" && !hash_ids ? "sequential" : entry.second) != 0) {
+            success = false;
+        }
+    }
+
+    if (db.finish() != 0) {
+        std::cerr << "Failed to finish '" << out << "'\n";
+        success = false;
+    }
+
+    return success ? 0 : 1;
+}
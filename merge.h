@@ -0,0 +1,10 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Combines shard databases, written by separate ctypefind runs with the same
+// schema, into a new database `out`. Row ids are remapped and rows that
+// already exist under a unique key are dropped. Up to `jobs` shards are read
+// ahead in parallel while the previous ones are written.
+int merge(const std::string &out, const std::vector<std::string> &shards, int jobs);
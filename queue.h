@@ -0,0 +1,59 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// A bounded single-producer/single-consumer ring buffer. push() waits while
+// the queue is full and pop() waits while it is empty.
+template <class T>
+class BoundedQueue {
+  private:
+    std::vector<T> items_;
+    size_t mask_;
+    std::atomic<size_t> head_;  // next slot to pop, owned by the consumer
+    std::atomic<size_t> tail_;  // next slot to push, owned by the producer
+
+    static void backoff(int &spins) {
+        if (++spins < 64) {
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+    }
+
+  public:
+    // capacity is rounded up to a power of two.
+    BoundedQueue(size_t capacity) : head_(0), tail_(0) {
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        items_.resize(size);
+        mask_ = size - 1;
+    }
+
+    void push(T &&item) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        int spins = 0;
+        while (tail - head_.load(std::memory_order_acquire) > mask_) {
+            backoff(spins);
+        }
+        items_[tail & mask_] = std::move(item);
+        tail_.store(tail + 1, std::memory_order_release);
+    }
+
+    void pop(T &item) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        int spins = 0;
+        while (tail_.load(std::memory_order_acquire) == head) {
+            backoff(spins);
+        }
+        item = std::move(items_[head & mask_]);
+        items_[head & mask_] = T();
+        head_.store(head + 1, std::memory_order_release);
+    }
+};
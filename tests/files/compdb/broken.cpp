@@ -0,0 +1,5 @@
+#include "shape.h"
+
+int broken_area(const Shape &s) {
+    return s.width * s.height;
+}
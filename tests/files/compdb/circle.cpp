@@ -0,0 +1,14 @@
+#include "shape.h"
+
+struct Circle {
+    Shape bounds;
+    int radius;
+};
+
+int circle_area(const Circle &c) {
+    return 3 * c.radius * c.radius;
+}
+
+int circle_bounds_area(const Circle &c) {
+    return c.bounds.area();
+}
@@ -0,0 +1,5 @@
+#include "options.h"
+
+int options_size(const Options &o) {
+    return o.size;
+}
@@ -0,0 +1,14 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#ifdef WIDE_OPTIONS
+struct WideOptions {
+    long size;
+};
+#else
+struct Options {
+    int size;
+};
+#endif
+
+#endif
@@ -0,0 +1,9 @@
+#include "shape.h"
+
+int Shape::area() const {
+    return width * width;
+}
+
+struct Square : Shape {
+    int side() const;
+};
@@ -0,0 +1,9 @@
+#ifndef SHAPE_H
+#define SHAPE_H
+
+struct Shape {
+    int width;
+    int area() const;
+};
+
+#endif
@@ -0,0 +1,6 @@
+#define WIDE_OPTIONS
+#include "options.h"
+
+long wide_size(const WideOptions &o) {
+    return o.size;
+}
@@ -0,0 +1,6 @@
+#define WIDE_OPTIONS
+#include "options.h"
+
+long wide_broken(const WideOptions &o) {
+    return o.missing;
+}
@@ -2,13 +2,16 @@ import subprocess
 import unittest
 import pprint
 import json
-from util import DB_NAME, all, load_json
+import os
+import shutil
+import tempfile
+from util import DB_NAME, all, connect, load_json
 
 pp = pprint.PrettyPrinter(indent=4)  # pp.pprint(dict(row))
 
-def parse(filename: str):
+def parse(filename: str, *options: str):
     return subprocess.call([
-        "./ctypefind", "--db", DB_NAME, "--truncate", "--", "-std=c++11",
+        "./ctypefind", "--db", DB_NAME, "--truncate", *options, "--", "-std=c++11",
         "-fparse-all-comments", "-c", filename
     ])
 
@@ -19,15 +22,376 @@ class TestDecls(unittest.TestCase):
         self.assertEqual(parse(self.filename), 0)
 
     def test_insert_decls(self):
-        inserted = all("from decl order by name")
+        inserted = all("from v_decl order by name")
         expected = load_json('decls')['decl']
         self.assertEqual(inserted, expected)
 
     def test_insert_files(self):
-        inserted = all("from file order by path")
+        inserted = all("id, path from file order by path")
         expected = load_json('decls')['file']
         self.assertEqual(inserted, expected)
 
+    def test_reindex(self):
+        before = all("from v_decl order by name")
+        self.assertEqual(subprocess.call([
+            "./ctypefind", "--db", DB_NAME, "--", "-std=c++11", "-fparse-all-comments", "-c", self.filename
+        ]), 0)
+        self.assertEqual(all("from v_decl order by name"), before)
+
+    def test_remove_file(self):
+        self.assertEqual(subprocess.call(["./ctypefind", "--db", DB_NAME, "--remove", self.filename]), 0)
+        self.assertEqual(all("count(*) as n from file"), [{'n': 0}])
+        for table in ["decl", "decl_field", "enum_field", "func", "var_decl", "var_ref", "fcall"]:
+            self.assertEqual(all(f"count(*) as n from {table} where file_id is not null"), [{'n': 0}], table)
+
+
+class TestComments(unittest.TestCase):
+
+    def setUp(self):
+        self.filename = 'tests/files/decls.cpp'
+        self.assertEqual(parse(self.filename, "--comments=full"), 0)
+
+    def test_insert_comments(self):
+        inserted = all("from comment order by id")
+        expected = load_json('decls')['comment']
+        self.assertEqual(inserted, expected)
+
+
+class TestOldSchema(unittest.TestCase):
+
+    def setUp(self):
+        self.filename = 'tests/files/decls.cpp'
+        if os.path.exists(DB_NAME):
+            os.remove(DB_NAME)
+        # The layout before names were moved to the string table.
+        conn, cursor = connect()
+        cursor.executescript("""
+            create table file(id integer primary key, path varchar(1024));
+            create table decl(id integer primary key, name varchar(255), type varchar(30), file_id int);
+            insert into decl(name, type) values ('old', 'class');
+        """)
+        conn.commit()
+        conn.close()
+
+    def index(self, *options: str):
+        return subprocess.call([
+            "./ctypefind", "--db", DB_NAME, *options, "--", "-std=c++11", "-fparse-all-comments", "-c", self.filename
+        ])
+
+    def test_refuse_without_truncate(self):
+        self.assertNotEqual(self.index(), 0)
+        self.assertEqual(all("name from decl"), [{'name': 'old'}])
+
+    def test_truncate(self):
+        self.assertEqual(self.index("--truncate"), 0)
+        self.assertEqual(all("from v_decl order by name"), load_json('decls')['decl'])
+
+
+# Lists the translation units `names` in the compile_commands.json of `dir`.
+def write_compdb(dir: str, names):
+    with open(os.path.join(dir, 'compile_commands.json'), 'w') as fp:
+        json.dump([{'directory': dir, 'file': name, 'arguments': ['c++', '-std=c++11', '-c', name]}
+                   for name in names], fp)
+
+
+# Copies tests/files/compdb to a new directory and writes its compile_commands.json.
+def make_compdb():
+    dir = os.path.realpath(tempfile.mkdtemp())
+    for name in ['shape.h', 'shape.cpp', 'circle.cpp']:
+        shutil.copy(f'tests/files/compdb/{name}', dir)
+    write_compdb(dir, ['shape.cpp', 'circle.cpp'])
+    return dir
+
+
+def index_compdb(dir: str, db: str, *options: str):
+    return subprocess.run(["./ctypefind", "--db", db, *options, "--accept", dir, "--compdb", dir],
+                          stdout=subprocess.PIPE, universal_newlines=True)
+
+
+# Rows without their ids, which differ between databases indexed differently.
+def snapshot(db: str = DB_NAME):
+    return {
+        'decl': all("d.type, d.name, f.path, d.start_line, d.end_line, d.start_column, d.end_column, "
+                    "d.underlying_type, d.is_struct, d.is_abstract, d.is_template, d.is_scoped "
+                    "from v_decl d left join file f on f.id = d.file_id order by 2, 3, 4, 6", db),
+        'func': all("u.name, u.qual_name, u.signature, f.path, u.start_line, u.end_line, u.start_column, "
+                    "u.end_column, d.name as decl, u.access, u.is_static, u.is_inline, u.is_virtual, u.is_const "
+                    "from v_func u left join file f on f.id = u.file_id left join v_decl d on d.id = u.decl_id "
+                    "order by 3, 4, 5", db),
+        'decl_base': all("d.name as decl, b.name as base, position, access from decl_base "
+                         "join v_decl d on d.id = decl_id join v_decl b on b.id = base_id order by 1, 2", db),
+        'decl_field': all("d.name as decl, x.name, x.access, f.path, x.start_line, x.end_line, x.start_column, "
+                          "x.end_column from decl_field x join v_decl d on d.id = x.decl_id "
+                          "left join file f on f.id = x.file_id order by 1, 2", db),
+        'type': all("name, decl_name, decl_kind, indirection, template_parameter_index from v_type order by 1", db),
+        'var_decl': all("v.name, c.name as class, f.path, v.start_line, v.end_line, v.start_column, v.end_column "
+                        "from var_decl v left join v_decl c on c.id = v.class_id left join file f on f.id = v.file_id "
+                        "order by 3, 5, 7, 1", db),
+        'var_ref': all("f.path, r.start_line, r.end_line, r.start_column, r.end_column "
+                       "from var_ref r left join file f on f.id = r.file_id order by 1, 3, 5", db),
+        'fcall': all("f.path, c.start_line, c.end_line, c.start_column, c.end_column "
+                     "from fcall c left join file f on f.id = c.file_id order by 1, 3, 5", db),
+    }
+
+
+class TestCompdb(unittest.TestCase):
+
+    def setUp(self):
+        self.dir = make_compdb()
+        self.assertEqual(self.index("--truncate").returncode, 0)
+
+    def tearDown(self):
+        shutil.rmtree(self.dir)
+
+    def index(self, *options: str):
+        return index_compdb(self.dir, DB_NAME, *options)
+
+    def skipped(self, result):
+        prefix = "Skipping unchanged "
+        return sorted(os.path.basename(line[len(prefix):]) for line in result.stdout.splitlines()
+                      if line.startswith(prefix))
+
+    def names(self, query):
+        return sorted(row['name'] for row in all(query))
+
+    def test_skip_unchanged(self):
+        before = all("from v_decl order by name")
+        result = self.index("--verbose")
+        self.assertEqual(result.returncode, 0)
+        self.assertEqual(self.skipped(result), ['circle.cpp', 'shape.cpp'])
+        self.assertEqual(all("from v_decl order by name"), before)
+
+    def test_ids_mode(self):
+        self.assertNotEqual(self.index("--hash-ids").returncode, 0)
+        self.assertEqual(self.index("--truncate", "--hash-ids").returncode, 0)
+        self.assertNotEqual(self.index().returncode, 0)
+        self.assertEqual(self.index("--hash-ids").returncode, 0)
+        self.assertEqual(all("value from meta where key = 'ids'"), [{'value': 'hash'}])
+
+    # Same size, and likely the same second as the first run.
+    def rename_circle(self):
+        path = os.path.join(self.dir, 'circle.cpp')
+        with open(path) as fp:
+            source = fp.read()
+        with open(path, 'w') as fp:
+            fp.write(source.replace('Circle', 'Sphere').replace('circle', 'sphere').replace('radius', 'length'))
+
+    def test_reindex_changed(self):
+        self.rename_circle()
+        result = self.index("--verbose")
+        self.assertEqual(result.returncode, 0)
+        self.assertEqual(self.skipped(result), ['shape.cpp'])
+
+        decls = self.names("name from v_decl where file_id is not null")
+        self.assertIn('Sphere', decls)
+        self.assertIn('Shape', decls)
+        self.assertNotIn('Circle', decls)
+        fields = self.names("name from decl_field")
+        self.assertIn('length', fields)
+        self.assertIn('width', fields)
+        self.assertNotIn('radius', fields)
+        funcs = self.names("name from v_func")
+        self.assertIn('sphere_area', funcs)
+        self.assertIn('area', funcs)
+        self.assertNotIn('circle_area', funcs)
+
+    def test_failed_after_changed(self):
+        self.rename_circle()
+        shutil.copy('tests/files/compdb/broken.cpp', self.dir)
+        write_compdb(self.dir, ['shape.cpp', 'circle.cpp', 'broken.cpp'])
+        self.assertNotEqual(self.index().returncode, 0)
+
+        # The functions circle.cpp dropped are still deleted after broken.cpp is rolled back.
+        funcs = self.names("name from v_func")
+        self.assertIn('sphere_area', funcs)
+        self.assertNotIn('circle_area', funcs)
+        self.assertNotIn('broken_area', funcs)
+
+    def test_failed_not_skipped(self):
+        shutil.copy('tests/files/compdb/broken.cpp', self.dir)
+        write_compdb(self.dir, ['shape.cpp', 'circle.cpp', 'broken.cpp'])
+        for jobs in ["1", "2"]:
+            self.assertNotEqual(self.index("--truncate", "-j", jobs).returncode, 0)
+            result = self.index("--verbose", "-j", jobs)
+            self.assertNotEqual(result.returncode, 0)
+            self.assertEqual(self.skipped(result), ['circle.cpp', 'shape.cpp'])
+
+    def test_extract_types_only(self):
+        self.assertNotEqual(self.index("--truncate", "--extract", "types").returncode, 0)
+        self.assertEqual(self.index("--truncate", "--extract", "types,funcs").returncode, 0)
+        self.assertIn('Circle', self.names("decl_name as name from v_type where decl_name is not null"))
+
+    def test_macro_before_include(self):
+        for name in ['options.h', 'narrow.cpp', 'wide.cpp']:
+            shutil.copy(f'tests/files/compdb/{name}', self.dir)
+        write_compdb(self.dir, ['narrow.cpp', 'wide.cpp'])
+        self.assertEqual(self.index("--truncate").returncode, 0)
+        decls = self.names("name from v_decl where file_id is not null")
+        self.assertIn('Options', decls)
+        self.assertIn('WideOptions', decls)
+
+    def test_failed_with_commit_every(self):
+        for name in ['options.h', 'narrow.cpp', 'wide_broken.cpp', 'options.cpp']:
+            shutil.copy(f'tests/files/compdb/{name}', self.dir)
+        write_compdb(self.dir, ['narrow.cpp', 'wide_broken.cpp', 'options.cpp'])
+        self.assertNotEqual(self.index("--truncate", "--commit-every", "1").returncode, 0)
+        # The rollback removed every row of options.h, so options.cpp indexes it again.
+        decls = self.names("name from v_decl where file_id is not null")
+        self.assertIn('Options', decls)
+        self.assertNotIn('WideOptions', decls)
+
+
+# The tables each --extract family writes, and the snapshot parts that show them.
+EXTRACT_TABLES = {
+    'decls': ['decl_field', 'decl_base'],
+    'types': ['type'],
+    'funcs': ['func'],
+    'calls': ['fcall'],
+    'refs': ['var_ref'],
+    'vars': ['var_decl'],
+    'locals': ['var_decl'],
+}
+
+
+# Drops the names joined from decl, which is empty unless decls are extracted too.
+def without_decls(rows):
+    return [{key: value for key, value in row.items() if key not in ['decl', 'class']} for row in rows]
+
+
+# Indexes tests/files/compdb with each option and compares the rows with those of a plain run.
+class TestOptions(unittest.TestCase):
+
+    def setUp(self):
+        self.dir = make_compdb()
+        self.assertEqual(self.index(DB_NAME).returncode, 0)
+        self.expected = snapshot()
+
+    def tearDown(self):
+        shutil.rmtree(self.dir)
+
+    def index(self, db: str, *options: str):
+        return index_compdb(self.dir, db, "--truncate", *options)
+
+    def check_same(self, *options: str):
+        db = os.path.join(self.dir, 'options.db')
+        self.assertEqual(self.index(db, *options).returncode, 0)
+        self.assertEqual(snapshot(db), self.expected)
+
+    def test_fast_load(self):
+        self.check_same("--fast-load")
+
+    def test_defer_indexes(self):
+        self.check_same("--defer-indexes")
+
+    def test_async_writes(self):
+        self.check_same("--async-writes")
+
+    def test_jobs(self):
+        self.check_same("-j", "2")
+
+    def test_all_options(self):
+        self.check_same("--fast-load", "--defer-indexes", "--async-writes", "-j", "2")
+
+    def test_extract(self):
+        for profile in ['decls', 'types,funcs', 'funcs', 'calls', 'refs', 'vars', 'locals']:
+            with self.subTest(profile=profile):
+                db = os.path.join(self.dir, 'options.db')
+                self.assertEqual(self.index(db, "--extract", profile).returncode, 0)
+                rows = snapshot(db)
+                tables = [table for family in profile.split(',') for table in EXTRACT_TABLES[family]]
+                for part in ['decl_field', 'decl_base', 'type', 'func', 'var_decl', 'var_ref', 'fcall']:
+                    actual = without_decls(rows[part])
+                    expected = without_decls(self.expected[part])
+                    if part not in tables:
+                        self.assertEqual(actual, [], part)
+                    elif part in ['var_decl', 'type']:
+                        # Shared with other families.
+                        self.assertTrue(actual, part)
+                        self.assertEqual([row for row in actual if row not in expected], [], part)
+                    else:
+                        self.assertEqual(actual, expected, part)
+
+    def test_extract_vars_and_locals(self):
+        db = os.path.join(self.dir, 'options.db')
+        rows = []
+        for profile in ['vars', 'locals']:
+            self.assertEqual(self.index(db, "--extract", profile).returncode, 0)
+            rows += without_decls(snapshot(db)['var_decl'])
+        key = lambda row: (row['path'], row['end_line'], row['end_column'], row['name'])
+        self.assertEqual(sorted(rows, key=key), sorted(without_decls(self.expected['var_decl']), key=key))
+
+    # A failed translation unit is rolled back, and with -j 1 leaves nothing behind.
+    def check_failed(self, *options: str):
+        shutil.copy('tests/files/compdb/broken.cpp', self.dir)
+        write_compdb(self.dir, ['shape.cpp', 'circle.cpp', 'broken.cpp'])
+        db = os.path.join(self.dir, 'options.db')
+        self.assertNotEqual(self.index(db, *options).returncode, 0)
+        return snapshot(db)
+
+    def test_failed(self):
+        self.assertEqual(self.check_failed("-j", "1"), self.expected)
+
+    def test_failed_commit_every(self):
+        self.assertEqual(self.check_failed("-j", "1", "--commit-every", "1"), self.expected)
+
+    # With -j 2, the other translation units' rows still land next to the failed one.
+    def test_failed_jobs(self):
+        rows = self.check_failed("-j", "2")
+        for part, expected in self.expected.items():
+            self.assertEqual([row for row in expected if row not in rows[part]], [], part)
+
+
+class TestMerge(unittest.TestCase):
+
+    def setUp(self):
+        self.dir = make_compdb()
+
+    def tearDown(self):
+        shutil.rmtree(self.dir)
+
+    def path(self, name):
+        return os.path.join(self.dir, name)
+
+    def merge(self, *options: str):
+        shards = []
+        for i in range(2):
+            shards.append(self.path(f'shard{i}.db'))
+            self.assertEqual(index_compdb(self.dir, shards[-1], "--truncate", *options,
+                                          "--shard", f"{i}/2").returncode, 0)
+        self.assertEqual(index_compdb(self.dir, DB_NAME, "--truncate", *options).returncode, 0)
+        self.assertEqual(subprocess.call(["./ctypefind", "merge", self.path('merged.db'), *shards]), 0)
+        return shards
+
+    def test_merge(self):
+        self.merge()
+        merged = snapshot(self.path('merged.db'))
+        self.assertEqual(merged, snapshot(DB_NAME))
+        self.assertEqual([row['decl'] for row in merged['decl_base']], ['Square'])
+
+    def test_merge_hash_ids(self):
+        self.merge("--hash-ids")
+        merged = snapshot(self.path('merged.db'))
+        self.assertEqual(merged, snapshot(DB_NAME))
+        # Rows are copied without remapping, so they keep the ids of an unsharded run.
+        ids = "id, name from v_decl order by id"
+        self.assertEqual(all(ids, self.path('merged.db')), all(ids))
+        self.assertEqual(all("value from meta where key = 'ids'", self.path('merged.db')), [{'value': 'hash'}])
+
+    def test_merge_shared_dependencies(self):
+        # Both databases index every translation unit, so they share every dependency.
+        shards = [self.path('a.db'), self.path('b.db')]
+        for shard in shards:
+            self.assertEqual(index_compdb(self.dir, shard, "--truncate", "--hash-ids").returncode, 0)
+        self.assertEqual(subprocess.call(["./ctypefind", "merge", self.path('merged.db'), *shards]), 0)
+        dependencies = "tu_id, file_id from tu_dependency order by 1, 2"
+        self.assertEqual(all(dependencies, self.path('merged.db')), all(dependencies, shards[0]))
+
+    def test_merge_into_shard(self):
+        shards = self.merge()
+        before = snapshot(shards[0])
+        self.assertNotEqual(subprocess.call(["./ctypefind", "merge", shards[0], *shards]), 0)
+        self.assertEqual(snapshot(shards[0]), before)
+
 
 if __name__ == '__main__':
     unittest.main()
@@ -3,8 +3,8 @@ import json
 import sqlite3
 
 DB_NAME = "typetests.db"
-def connect():
-    conn = sqlite3.connect(DB_NAME)
+def connect(db=DB_NAME):
+    conn = sqlite3.connect(db)
     conn.row_factory = sqlite3.Row
     return conn, conn.cursor()
 
@@ -22,14 +22,14 @@ def lines(filename):
     return result
 
 
-def first(query):
-    _, cursor = connect()
+def first(query, db=DB_NAME):
+    _, cursor = connect(db)
     cursor.execute(select(query))
     return cursor.fetchone()
 
 
-def all(query):
-    _, cursor = connect()
+def all(query, db=DB_NAME):
+    _, cursor = connect(db)
     cursor.execute(select(query))
     columns = [column[0] for column in cursor.description]
     rows= []
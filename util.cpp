@@ -10,6 +10,7 @@
 #endif
 
 #include <unistd.h>
+#include <sys/stat.h>
 
 #ifdef WIN32
 #include <io.h>
@@ -25,6 +26,18 @@ bool file_exists(const std::string& filename) {
     return file_exists(filename.c_str());
 }
 
+bool same_file(const std::string& a, const std::string& b) {
+#ifdef _WIN32
+    char full_a[MAX_PATH], full_b[MAX_PATH];
+    return file_exists(a) && _fullpath(full_a, a.c_str(), MAX_PATH) && _fullpath(full_b, b.c_str(), MAX_PATH) &&
+           _stricmp(full_a, full_b) == 0;
+#else
+    struct stat stat_a, stat_b;
+    return stat(a.c_str(), &stat_a) == 0 && stat(b.c_str(), &stat_b) == 0 && stat_a.st_dev == stat_b.st_dev &&
+           stat_a.st_ino == stat_b.st_ino;
+#endif
+}
+
 std::string get_exec_name() {
     std::string str;
 
@@ -60,3 +73,16 @@ std::string get_exec_path() {
     }
     return str;
 }
+
+uint64_t fnv1a(const void *data, size_t size, uint64_t hash) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+uint64_t fnv1a(const std::string &str, uint64_t hash) {
+    return fnv1a(str.data(), str.size(), hash);
+}
@@ -1,10 +1,18 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
 #include <string>
 #include <errno.h>
 
 #include <string>
 
 bool file_exists(const std::string&);
+// False when either file does not exist.
+bool same_file(const std::string&, const std::string&);
 std::string get_exec_name();
 std::string get_exec_path();
+
+// 64-bit FNV-1a; `hash` continues from a previous call.
+uint64_t fnv1a(const void *data, size_t size, uint64_t hash = 14695981039346656037ULL);
+uint64_t fnv1a(const std::string &str, uint64_t hash = 14695981039346656037ULL);